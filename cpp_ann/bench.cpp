@@ -0,0 +1,253 @@
+#include <sstream>
+#include <iostream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <string.h>
+#include <chrono>
+#include "network.h"
+
+using namespace std;
+
+/*
+Micro-benchmarks of the Network kernels over synthetic random patterns.
+
+./sparsenet_bench [--quick] [--threads n] [--reps n] [--filter text] [--renumber] [--tile n]
+
+--quick:     K=24 and w=0.5 only
+--threads n: threads of the networks (default 1)
+--reps n:    repetitions of each benchmark, the fastest one is reported (default 3)
+--filter s:  runs only the benchmarks whose name contains s
+--renumber:  renumbers every network after its construction (reported as the
+             renumber benchmark, with the mean neighbor distance before and
+             after on stderr), to compare against a run without it
+--tile n:    tile width of the c and x grid sweeps, -1 for whole rows (default 0: from the L2 size)
+
+Networks are N=89420 (263x340 patterns) for K=24 and 240, topologies r, c, x
+and w=0, 0.5, 1, trained with BENCH_PATTERNS random patterns of sparseness
+BENCH_SPARSENESS. Each benchmark prints a CSV line (after a header line):
+
+    version,bench,N,K,w,top,threads,reps,seconds,node_updates_s,edges_s,bytes_s
+
+seconds is the time of one repetition; bytes_s counts the arrays the kernel
+streams (adjacency, weights, states, thresholds, pattern file), not the cache
+traffic. version is the one given at compile time (make bench uses git describe).
+*/
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+#define BENCH_NEURONS 89420
+#define BENCH_WIDTH 263
+#define BENCH_HEIGHT 340
+#define BENCH_PATTERNS 10
+#define BENCH_SPARSENESS 0.2258
+#define BENCH_SEED 12345
+
+struct BenchOptions {
+    bool quick;
+    int threads;
+    int reps;
+    const char * filter;
+    bool renumber;
+    int tile;
+};
+
+typedef chrono::steady_clock BenchClock;
+
+static double seconds(BenchClock::time_point t0) {
+    return chrono::duration<double>(BenchClock::now() - t0).count();
+}
+
+//Random pattern of the given sparseness, from its own stream
+static BitState randomPattern(int neurons, double sparseness, int id) {
+    RandomStream rng(BENCH_SEED, 0, id, RNG_NETWORK);
+    BitState v(neurons);
+    for (int i = 0; i < neurons; i++)
+        v.set(i, rng.unif() < sparseness);
+    return v;
+}
+
+static bool selected(const BenchOptions & op, const char * bench) {
+    return op.filter == NULL || strstr(bench, op.filter) != NULL;
+}
+
+static void report(const BenchOptions & op, const char * bench, int K, double w, char top,
+    double t, double nodes, double edges, double bytes) {
+    printf("%s,%s,%d,%d,%g,%c,%d,%d,%.6f,%.4g,%.4g,%.4g\n", BENCH_VERSION, bench, BENCH_NEURONS, K, w,
+        top, op.threads, op.reps, t, nodes / t, edges / t, bytes / t);
+    fflush(stdout);
+}
+
+//loadPatternFile over a text pattern file written from a random pattern
+static void benchLoad(const BenchOptions & op) {
+    if (selected(op, "load") == false)
+        return;
+
+    char file[] = "bench_pattern.txt";
+    BitState v = randomPattern(BENCH_NEURONS, BENCH_SPARSENESS, 0);
+    FILE * f = fopen(file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Can not write %s\n", file);
+        return;
+    }
+    for (int i = 0; i < BENCH_NEURONS; i++)
+        fprintf(f, "%d ", (int)v.get(i));
+    long bytes = ftell(f);
+    fclose(f);
+
+    Network Net(BENCH_NEURONS, 24, 0, BENCH_WIDTH, BENCH_HEIGHT, 'r', op.threads, BENCH_SEED);
+    double best = 1e30;
+    for (int r = 0; r < op.reps; r++) {
+        BenchClock::time_point t0 = BenchClock::now();
+        Net.loadPatternFile(file);
+        best = min(best, seconds(t0));
+    }
+    remove(file);
+    report(op, "load", 0, 0, '-', best, BENCH_NEURONS, 0, bytes);
+}
+
+//Construction, learning, update and statistics of one network configuration
+static void benchNetwork(const BenchOptions & op, int K, double w, char top,
+    const vector<BitState> & patterns) {
+
+    double N = BENCH_NEURONS;
+
+    //Construction
+    unique_ptr<Network> net;
+    double best = 1e30;
+    for (int r = 0; r < op.reps; r++) {
+        BenchClock::time_point t0 = BenchClock::now();
+        net.reset(new Network(BENCH_NEURONS, K, w, BENCH_WIDTH, BENCH_HEIGHT, top, op.threads, BENCH_SEED));
+        best = min(best, seconds(t0));
+    }
+    Network & Net = *net;
+    Net.setThreads(op.threads);
+    Net.setTileWidth(op.tile);
+    double E = Net.edges();
+    if (selected(op, "build"))
+        report(op, "build", K, w, top, best, N, E, 4 * (E + N + 1));
+
+    //Renumbering, once: the benchmarks below run on the renumbered network
+    if (op.renumber) {
+        double before = Net.neighborDistance();
+        BenchClock::time_point t0 = BenchClock::now();
+        Net.renumberNodes();
+        double t = seconds(t0);
+        fprintf(stderr, "K=%d w=%g top=%c: mean neighbor distance %.1f -> %.1f%s\n", K, w, top, before,
+            Net.neighborDistance(), Net.renumbered() ? "" : " (original order kept)");
+        if (selected(op, "renumber"))
+            report(op, "renumber", K, w, top, t, N, E, 8 * (E + N + 1));
+    }
+
+    //Learning of one pattern, the network learns all of them once
+    best = 1e30;
+    for (int p = 0; p < BENCH_PATTERNS; p++) {
+        BenchClock::time_point t0 = BenchClock::now();
+        Net.hebbLearning(patterns[p].data());
+        best = min(best, seconds(t0));
+    }
+    if (selected(op, "hebb"))
+        report(op, "hebb", K, w, top, best, N, E, 20 * E);
+
+    //Bytes of a step: adjacency and weights of every edge, thresholds and states
+    double step_bytes = (4 + Net.weightBytes()) * E + 8 * N + 2 * N / 8;
+
+    //One update step from a noisy pattern
+    if (selected(op, "step")) {
+        best = 1e30;
+        for (int r = 0; r < op.reps; r++) {
+            Net.setNoiseProbe(r);
+            Net.networkInitialCodition(0.1, patterns[0].data());
+            BenchClock::time_point t0 = BenchClock::now();
+            Net.updateNet(1, 1, BENCH_SPARSENESS, 'r', 0.656, BENCH_PATTERNS, "", false, 100, 0.7);
+            best = min(best, seconds(t0));
+        }
+        report(op, "step", K, w, top, best, N, E, step_bytes);
+    }
+
+    //Full retrieval, rates over the steps it took
+    if (selected(op, "retrieval")) {
+        best = 1e30;
+        double steps = 1;
+        for (int r = 0; r < op.reps; r++) {
+            Net.setNoiseProbe(r);
+            Net.networkInitialCodition(0.1, patterns[r % BENCH_PATTERNS].data());
+            BenchClock::time_point t0 = BenchClock::now();
+            vector<double> out = Net.updateNet(100, 1, BENCH_SPARSENESS, 'r', 0.656, BENCH_PATTERNS, "",
+                false, 100, 0.7);
+            double t = seconds(t0);
+            if (t < best) {
+                best = t;
+                steps = out[6] + 1;
+            }
+        }
+        report(op, "retrieval", K, w, top, best, N * steps, E * steps, step_bytes * steps);
+    }
+
+    //Overlap statistics of a state against a pattern
+    if (selected(op, "md")) {
+        BitState V1 = patterns[0];
+        BitState V2 = patterns[1];
+        best = 1e30;
+        for (int r = 0; r < op.reps; r++) {
+            BenchClock::time_point t0 = BenchClock::now();
+            Net.mdCalculate(1, BENCH_SPARSENESS, V1, V2);
+            best = min(best, seconds(t0));
+        }
+        report(op, "md", K, w, top, best, N, 0, 8 * N + 2 * N / 8);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions op;
+    op.quick = false;
+    op.threads = 1;
+    op.reps = 3;
+    op.filter = NULL;
+    op.renumber = false;
+    op.tile = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0)
+            op.quick = true;
+        else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+            op.threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--reps") == 0 && i+1 < argc)
+            op.reps = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--filter") == 0 && i+1 < argc)
+            op.filter = argv[++i];
+        else if (strcmp(argv[i], "--renumber") == 0)
+            op.renumber = true;
+        else if (strcmp(argv[i], "--tile") == 0 && i+1 < argc)
+            op.tile = atoi(argv[++i]);
+        else {
+            printf("Usage: ./sparsenet_bench [--quick] [--threads n] [--reps n] [--filter text] [--renumber] [--tile n]\n");
+            return 1;
+        }
+    }
+
+    vector<BitState> patterns;
+    for (int p = 0; p < BENCH_PATTERNS; p++)
+        patterns.push_back(randomPattern(BENCH_NEURONS, BENCH_SPARSENESS, p + 1));
+
+    puts("version,bench,N,K,w,top,threads,reps,seconds,node_updates_s,edges_s,bytes_s");
+
+    benchLoad(op);
+
+    int Ks[2] = {24, 240};
+    double ws[3] = {0, 0.5, 1};
+    const char * tops = "rcx";
+    for (int k = 0; k < (op.quick ? 1 : 2); k++)
+        for (int t = 0; t < 3; t++)
+            for (int i = 0; i < 3; i++) {
+                if (op.quick && ws[i] != 0.5)
+                    continue;
+                benchNetwork(op, Ks[k], ws[i], tops[t], patterns);
+            }
+
+    return 0;
+}
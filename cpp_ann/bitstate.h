@@ -0,0 +1,244 @@
+#ifndef BITSTATE_H_
+#define BITSTATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <new>
+#include <vector>
+#include "rng.h"
+
+using namespace std;
+
+//Size in bytes of a cache line
+#define CACHE_LINE 64
+
+//Allocator aligning vector storage to a cache line
+template <class T>
+struct CacheAlignedAllocator {
+    typedef T value_type;
+
+    CacheAlignedAllocator() {}
+    template <class U> CacheAlignedAllocator(const CacheAlignedAllocator<U> &) {}
+
+    T * allocate(size_t n) {
+        return (T *)::operator new(n * sizeof(T), align_val_t(CACHE_LINE));
+    }
+    void deallocate(T * p, size_t) {
+        ::operator delete(p, align_val_t(CACHE_LINE));
+    }
+
+    template <class U> bool operator==(const CacheAlignedAllocator<U> &) const { return true; }
+    template <class U> bool operator!=(const CacheAlignedAllocator<U> &) const { return false; }
+};
+
+//Returns bit i of a packed word array
+static inline int bitAt(const uint64_t * w, int i) {
+    return (int)((w[i >> 6] >> (i & 63)) & 1);
+}
+
+//Number of set bits of a word
+static inline int popCount(uint64_t x) {
+    return __builtin_popcountll(x);
+}
+
+/*
+Transposes a 64x64 bit matrix in place:
+bit i of a[j] takes the value of bit j of a[i]
+*/
+static inline void transpose64(uint64_t a[64]) {
+    uint64_t m = 0x00000000FFFFFFFFULL;
+    for (int j = 32; j != 0; j >>= 1, m ^= (m << j)) {
+        for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+            uint64_t t = ((a[k] >> j) ^ a[k | j]) & m;
+            a[k] ^= t << j;
+            a[k | j] ^= t;
+        }
+    }
+}
+
+/*
+Packed binary network state: one bit per neuron in 64-bit words.
+Bit i is stored in word i/64 at position i%64, bits past size() are kept at 0
+so word-level counts never need a tail mask. Words start on a cache line, so
+ranges of 512 bits map to whole cache lines and can be written by different
+threads without sharing a line.
+*/
+class BitState {
+private:
+    int nbits; //number of bits (neurons)
+    vector<uint64_t, CacheAlignedAllocator<uint64_t> > words; //packed bits
+
+    //Mask selecting bits [a, b) of the word holding bit a, with a and b in the same word
+    static uint64_t rangeMask(int a, int b);
+
+public:
+    BitState();
+    BitState(int n);
+
+    //Sets the number of bits and the value of all of them
+    void assign(int n, bool value);
+
+    //Exchanges the bits of both states without copying them
+    void swap(BitState & o) {
+        words.swap(o.words);
+        std::swap(nbits, o.nbits);
+    }
+
+    int size() const { return nbits; }
+    int nwords() const { return (int)words.size(); }
+
+    uint64_t * data() { return words.data(); }
+    const uint64_t * data() const { return words.data(); }
+
+    bool get(int i) const { return bitAt(words.data(), i); }
+    bool operator[](int i) const { return get(i); }
+
+    void set(int i, bool value) {
+        uint64_t m = (uint64_t)1 << (i & 63);
+        if (value)
+            words[i >> 6] |= m;
+        else
+            words[i >> 6] &= ~m;
+    }
+
+    //Number of active bits
+    int count() const;
+
+    //Number of active bits in [a, b)
+    int countRange(int a, int b) const;
+
+    //Number of bits active in both states in [a, b)
+    int countAndRange(const BitState &, int a, int b) const;
+
+    //Number of bits that differ between both states
+    int hamming(const BitState &) const;
+
+    //Number of bits that differ between both states in the words [w0, w1)
+    int hammingWords(const BitState &, int w0, int w1) const;
+
+    //Number of active bits in the words [w0, w1)
+    int countWords(int w0, int w1) const;
+
+};
+
+BitState::BitState() : nbits(0) {
+}
+
+BitState::BitState(int n) {
+    assign(n, 0);
+}
+
+void BitState::assign(int n, bool value) {
+    nbits = n;
+    words.assign((n + 63) / 64, value ? ~(uint64_t)0 : 0);
+    if (value && (n & 63))
+        words.back() &= ((uint64_t)1 << (n & 63)) - 1;
+}
+
+uint64_t BitState::rangeMask(int a, int b) {
+    uint64_t hi = ((b & 63) == 0 && b > a) ? ~(uint64_t)0 : (((uint64_t)1 << (b & 63)) - 1);
+    return hi & (~(uint64_t)0 << (a & 63));
+}
+
+int BitState::count() const {
+    return countWords(0, nwords());
+}
+
+int BitState::countRange(int a, int b) const {
+    if (a >= b)
+        return 0;
+    int wa = a >> 6;
+    int wb = (b - 1) >> 6;
+    if (wa == wb)
+        return popCount(words[wa] & rangeMask(a, b));
+
+    int c = popCount(words[wa] & rangeMask(a, (wa + 1) * 64));
+    for (int w = wa + 1; w < wb; w++)
+        c += popCount(words[w]);
+    c += popCount(words[wb] & rangeMask(wb * 64, b));
+    return c;
+}
+
+int BitState::countAndRange(const BitState & other, int a, int b) const {
+    if (a >= b)
+        return 0;
+    const uint64_t * o = other.data();
+    int wa = a >> 6;
+    int wb = (b - 1) >> 6;
+    if (wa == wb)
+        return popCount(words[wa] & o[wa] & rangeMask(a, b));
+
+    int c = popCount(words[wa] & o[wa] & rangeMask(a, (wa + 1) * 64));
+    for (int w = wa + 1; w < wb; w++)
+        c += popCount(words[w] & o[w]);
+    c += popCount(words[wb] & o[wb] & rangeMask(wb * 64, b));
+    return c;
+}
+
+int BitState::hamming(const BitState & other) const {
+    return hammingWords(other, 0, nwords());
+}
+
+int BitState::hammingWords(const BitState & other, int w0, int w1) const {
+    const uint64_t * o = other.data();
+    int c = 0;
+    for (int w = w0; w < w1; w++)
+        c += popCount(words[w] ^ o[w]);
+    return c;
+}
+
+int BitState::countWords(int w0, int w1) const {
+    int c = 0;
+    for (int w = w0; w < w1; w++)
+        c += popCount(words[w]);
+    return c;
+}
+
+/*
+Last window states of a network evolution, to detect fixed points and cycles.
+Every state is hashed; a state with the hash of one of the last window states
+is compared word by word with it, so only exact repetitions are reported
+*/
+class StateHistory {
+private:
+    int window; //number of states kept
+    int nwords; //words per state
+    int stored; //states kept so far (up to window)
+    int pos; //slot of the next state
+    vector<uint64_t> hashes;
+    vector<uint64_t> states;
+
+public:
+    StateHistory(int window, int nwords) : window(window), nwords(nwords), stored(0), pos(0),
+        hashes(window), states((size_t)window * nwords) {}
+
+    //Hash of a packed state
+    static uint64_t hash(const uint64_t * s, int nwords) {
+        uint64_t h = nwords;
+        for (int w = 0; w < nwords; w++)
+            h = RandomStream::mix(h ^ s[w]) + w;
+        return h;
+    }
+
+    /*
+    Adds a state and returns L if it equals the state added L states before
+    (the smallest such L <= window, 1 is a fixed point), 0 otherwise
+    */
+    int push(const uint64_t * s) {
+        uint64_t h = hash(s, nwords);
+        int period = 0;
+        for (int L = 1; L <= stored && period == 0; L++) {
+            int i = (pos - L + window) % window;
+            if (hashes[i] == h && memcmp(&states[(size_t)i * nwords], s, nwords * sizeof(uint64_t)) == 0)
+                period = L;
+        }
+        hashes[pos] = h;
+        memcpy(&states[(size_t)pos * nwords], s, nwords * sizeof(uint64_t));
+        pos = (pos + 1) % window;
+        stored = stored < window ? stored + 1 : window;
+        return period;
+    }
+};
+
+#endif /*BITSTATE_H_*/
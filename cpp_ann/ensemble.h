@@ -0,0 +1,628 @@
+#ifndef ENSEMBLE_H_
+#define ENSEMBLE_H_
+
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <math.h>
+#include "network.h"
+#include "threadpool.h"
+#include "patternbank.h"
+#include "snapshot.h"
+#include "profile.h"
+#include "resultsink.h"
+#include "statetrace.h"
+
+using namespace std;
+
+//Parameters of a sparsenet run, see checkParameters in main.cpp
+struct SimParams {
+    int Neurons; //Number of nodes in the network
+    int Degree; //K-neighbors per node
+    double rewProb; //Rewiring Probability: Omega parameter
+    double sparseness; //Sparseness (activity level) of the learning patterns
+    int blocks; //Number of blocks in the patterns
+    char th_fun; //Threshold function
+    double th_value; //Threshold value: theta0
+    double rho; //Value of rho
+    double np; //Noise applied to initial states m0=1-np
+    int time; //Time steps for network evolution
+    int patterns; //Final pattern
+    int pat_int; //pattern interval
+    int x_win; //x_win points (mxi_t): measures mesoscopic parameters in x-size windows
+    int width; //pattern width
+    int height; //pattern height
+    char path1[256]; //learning patterns folder
+    char path2[256]; //initial state patterns folder
+    char topology; //network topology
+    int subsetSize; //subnet size (K_b)
+    int nNets; // number of subnets, nNets x subsetSize = patterns
+    int threads; //Threads for the whole run (0: all hardware threads)
+    bool batch; //Batched retrieval of the initial states
+    bool delta; //Event-driven network update
+    int cycles; //States checked for fixed points and cycles (0: off)
+    bool implicit; //Implicit lattice topology with the rewired edges only
+    bool renumber; //Renumbers the nodes of the trained modules for locality
+    bool verbose; //Prints run information
+    char weights; //Weight precision: d double, f float, i int16 fixed point
+    double w_check; //Tolerance of the weight accuracy check (0: no check)
+    char save_snapshot[256]; //Snapshot file receiving the trained modules ("": none)
+    char load_snapshot[256]; //Snapshot file with the trained modules to use ("": build and train)
+    unsigned long long seed; //Seed of the random streams of the modules (default: the clock)
+    char profile[256]; //JSON file receiving the run profile ("": no profiling)
+    bool npy; //Also writes the results as a .npy record array next to the text file
+    char trace[256]; //State trace file receiving the state of every step of every probe ("": no trace)
+    int workers; //Worker processes of a sweep (0: the jobs run in the sweep process)
+};
+
+//Read-only data shared by the modules of a run
+struct SharedInputs {
+    const PatternBank * learn; //Learning patterns (not loaded with a snapshot to load)
+    const PatternBank * init; //Initial state patterns
+    const SnapshotFile * snapshot; //Trained modules (NULL: build and train the modules)
+    SnapshotWriter * save; //Receives the trained modules (NULL: no snapshot)
+    RunProfile * profile; //Receives the phase times, probe steps and memory (NULL: no profiling)
+    StateTraceWriter * trace; //Receives the states of the probes (NULL: no trace)
+};
+
+//Retrieval result of one initial state pattern
+struct ProbeResult {
+    int ir; //Initial state pattern
+    double m; //Overlap at the last time step
+    int t; //Last time step
+    int cycle; //Period of the reached cycle, 1 for a fixed point (0: none or not detected)
+    double dm; //|m - m with double weights| in the weight accuracy check
+};
+
+//Receives the results of every module of a run, in module order
+typedef function<void(const vector<ProbeResult> &)> ModuleResults;
+
+//Overlap differences of the weight accuracy check
+struct AccuracyReport {
+    int probes; //Checked probes
+    int above; //Probes with dm above the tolerance
+    double max_dm; //Largest dm
+    double sum_dm; //Sum of dm
+};
+
+//Returns input pattern filename in the specified path (ruta)
+string returnFilePattern(int bS, int sS, const char * ruta);
+
+//Generates output file name from the parameters in argv[1..21]
+string returnFileName(char *argv[]);
+
+//Sets the parameters of a run from argv[1..21], see checkParameters in main.cpp
+void readParameters(char *argv[], SimParams & sp);
+
+//Sets the optional flags of a run to their defaults
+void defaultOptions(SimParams & sp);
+
+/*
+Builds module ni, learns its subset of patterns and runs the retrieval test
+for every initial state pattern, the network update uses net_threads threads.
+Patterns are read from the learn and init banks, which are shared by all the modules.
+With a snapshot the module network is read in place from it instead of being
+built and trained. The random streams of the module are keyed by sp.seed and ni.
+With sp.w_check every probe also runs with double weights from the same noise
+and dm gets the difference of the overlaps.
+*/
+vector<ProbeResult> runModule(const SimParams & sp, int ni, int net_threads, const char * file_out,
+    const SharedInputs & in);
+
+/*
+Runs the nNets modules and writes their results to file_out in module and
+pattern order. With more than one thread the modules run concurrently on a
+work-stealing TaskPool and each module is written as soon as all the modules
+before it are done.
+*/
+void runEnsemble(const SimParams & sp, const char * file_out);
+
+//Runs the modules of an ensemble from inputs already loaded (i.e. shared by the jobs of a sweep)
+void runEnsemble(const SimParams & sp, const char * file_out, const SharedInputs & in);
+
+//Runs the modules of an ensemble and hands their results to out instead of the result files
+void runEnsembleModules(const SimParams & sp, const char * file_out, const SharedInputs & in,
+    const ModuleResults & out);
+
+//Adds the learning and initial state patterns of a run to the banks
+void requestPatterns(const SimParams & sp, PatternBank & learn, PatternBank & init);
+
+//Concurrent modules of runEnsemble on a TaskPool of threads workers
+void runModules(const SimParams & sp, int threads, const char * file_out,
+    const SharedInputs & in, AccuracyReport & acc, const ModuleResults & out);
+
+//Appends the results of a module to the result sink, with the cycle period when detecting cycles
+void writeModuleResults(ResultSink & sink, const vector<ProbeResult> & res, bool cycles);
+
+//Adds the results of a module to the weight accuracy report
+void addAccuracy(AccuracyReport & acc, const vector<ProbeResult> & res, double tolerance);
+
+//Patterns learned by module ni, in learning order (the subset of ni, intervals 6 to pat_int)
+vector<PatternId> learnedPatterns(const SimParams & sp, int ni);
+
+string returnFilePattern(int bS, int sS, const char * ruta) {
+
+        ostringstream inputFile;
+
+        inputFile << ruta;
+        inputFile << bS << '_' << sS;
+
+        return inputFile.str();
+
+}
+
+/*
+Returns the filename for the output text file using the input parameters
+*/
+string returnFileName(char *argv[]) {
+
+    char * pch;
+    char * ruta;
+    char str0[256];
+    strcpy (str0,argv[18]);
+    pch = strtok (str0,"/");
+    while (pch != NULL)
+    {
+        ruta = pch;
+        pch = strtok (NULL, "/");
+    }
+
+    ostringstream outputFile;
+
+	outputFile << "N"
+	<< argv[1]
+    << "K" << argv[2]
+    << "w" << argv[3]
+    << "a" << argv[4]
+    << "b" << argv[5]
+    << "T" << argv[6]
+    << "t" << argv[7]
+    << "rho" << argv[8]
+    << "np" << argv[9]
+    << "time" << argv[10]
+    << "p" << argv[11]
+    << "P" << argv[12]
+    << "pi" << argv[13]
+    << "x" << argv[14]
+    << "w" << argv[15]
+    << "h" << argv[16]
+    << "TY" << argv[19]
+    << "SNS" << argv[20]
+    << "NN" << argv[21]
+    << "PW" << ruta << ".txt";
+
+    return outputFile.str();
+
+}
+
+void readParameters(char *argv[], SimParams & sp) {
+    sp.Neurons = atoi(argv[1]); //Number of nodes in the network
+    sp.Degree = atoi(argv[2]); //K-neighbors per node
+    sp.rewProb = atof(argv[3]); //Rewiring Probability: Omega parameter
+    sp.sparseness = atof(argv[4]); //Sparseness (activity level) of the learning patterns
+    sp.blocks = atoi(argv[5]); //Number of blocks in the patterns
+    sp.th_fun = *argv[6]; //Threshold function
+    sp.th_value = atof(argv[7]); //Threshold value: theta0
+    sp.rho = atof(argv[8]); //Value of rho
+    sp.np = atof(argv[9]); //Noise applied to initial states m0=1-np
+    sp.time = atoi(argv[10]); //Time steps for network evolution
+    sp.patterns = atoi(argv[12]); //Final pattern
+    sp.pat_int = atoi(argv[13]); //pattern interval
+    sp.x_win = atoi(argv[14]); //x_win points (mxi_t): measures mesoscopic parameters in x-size windows
+    sp.width = atoi(argv[15]); //pattern width
+    sp.height = atoi(argv[16]); //pattern height
+    strcpy(sp.path1, argv[17]); //learning patterns folder
+    strcpy(sp.path2, argv[18]); //initial state patterns folder
+    sp.topology = *argv[19]; //network topology
+    sp.subsetSize = atoi(argv[20]); //subnet size (K_b)
+    sp.nNets = atoi(argv[21]);  // number of subnets, nNets x subsetSize = patterns
+}
+
+void defaultOptions(SimParams & sp) {
+    sp.threads = 1; //Threads of the run
+    sp.batch = false; //Batched retrieval
+    sp.delta = false; //Event-driven update
+    sp.cycles = 0; //Cycle detection
+    sp.implicit = false; //Explicit adjacency list
+    sp.renumber = false; //Original node numbering
+    sp.verbose = false; //Run information
+    sp.weights = 'd'; //Weight precision
+    sp.w_check = 0; //Weight accuracy check
+    sp.save_snapshot[0] = 0; //Snapshot of the trained modules
+    sp.load_snapshot[0] = 0; //Trained modules from a snapshot
+    sp.seed = time(NULL); //Seed of the random streams
+    sp.profile[0] = 0; //Run profile
+    sp.npy = false; //Text results only
+    sp.trace[0] = 0; //State trace
+    sp.workers = 0; //Sweep jobs in the sweep process
+}
+
+vector<ProbeResult> runModule(const SimParams & sp, int ni, int net_threads, const char * file_out,
+    const SharedInputs & in) {
+
+    vector<ProbeResult> res;
+    const PatternBank & init = *in.init;
+
+    //Generating small-world network, or the trained network of the snapshot
+    unique_ptr<Network> net;
+    PhaseTimer construct(in.profile, PHASE_CONSTRUCT);
+    if (in.snapshot != NULL)
+        net.reset(new Network(in.snapshot->module(ni), sp.seed, ni));
+    else
+        net.reset(new Network(sp.Neurons, sp.Degree, sp.rewProb, sp.width, sp.height, sp.topology, net_threads,
+            sp.seed, ni));
+    Network & Net = *net;
+    Net.setThreads(net_threads);
+    Net.setWeightPrecision(sp.weights, sp.w_check > 0);
+    Net.setDeltaUpdate(sp.delta);
+    Net.setCycleWindow(sp.cycles);
+    Net.setImplicitTopology(sp.implicit);
+    Net.setProfile(in.profile);
+    Net.setTrace(in.trace, ni);
+    construct.stop();
+    if (sp.verbose && ni == 0)
+        printf("Topology: %.2f MB per module%s\n", Net.topologyBytes() / 1e6,
+            Net.implicitTopology() ? " (implicit lattice)" : "");
+    /*
+    Uncomment next line to printscreen the network topology
+    Notice that N=widthxheigt, i.e. Use: N=6x6=36, K=8, width=6, height=6
+    */
+    // Net.toString(); cin.get();
+
+    //Uncomment next line to printscreen adjacency matrix
+    //Net.toAdjMat(); cin.get();
+
+    /*
+    w_file = true prints simulation results for every time step
+    w_file = false prints simulation results for last time step
+    */
+    bool w_file = false;
+
+    //Loop the set of patterns for learning and retrieve testing.
+    //The subset of patterns of the module is learned by the network,
+    //and right after initializing in a state with np noise
+    //the network evolves for the given time steps.
+    if (in.snapshot == NULL) {
+        PhaseTimer learn(in.profile, PHASE_LEARN);
+        vector<const uint64_t *> subset;
+        vector<PatternId> learned = learnedPatterns(sp, ni);
+        for (size_t il=0;il<learned.size();il++) {
+
+            //Learning pattern from path1
+            subset.push_back(in.learn->get(learned[il].id, learned[il].interval));
+
+        }
+
+        //Hebb learning of the whole subset in one pass
+        Net.hebbLearningBatch(subset);
+
+        //Writing the snapshot expands an implicit lattice, the retrieval goes back to it
+        if (in.save != NULL) {
+            in.save->addModule(ni, Net, learned);
+            Net.setImplicitTopology(sp.implicit);
+        }
+        if (in.profile != NULL)
+            in.profile->addMemory(Net.memoryUse());
+    }
+
+    //Retrieval in the renumbered nodes, after the snapshot got the original numbering
+    if (sp.renumber) {
+        PhaseTimer renumber(in.profile, PHASE_CONSTRUCT);
+        double before = Net.neighborDistance();
+        Net.renumberNodes();
+        if (sp.verbose && ni == 0)
+            printf("Renumbering: mean neighbor distance %.1f -> %.1f%s\n", before, Net.neighborDistance(),
+                Net.renumbered() ? "" : " (original order kept)");
+    }
+
+    PhaseTimer retrieve(in.profile, PHASE_RETRIEVE);
+
+    //Weight accuracy check, probes run with the weight precision and with double weights
+    if (sp.w_check > 0) {
+        for (int ir=1;ir<=sp.patterns;ir++) {
+            for (int iir=6;iir<=sp.pat_int;iir++) {
+                uint64_t probe = Net.noiseProbe(); //Same noise for both runs
+
+                Net.setWeightPrecision(sp.weights, true);
+                Net.networkInitialCodition(sp.np, init.get(ir, iir));
+                Net.setTraceProbe(ir, iir); //Only the run with the weight precision
+                vector<double> output_values = Net.updateNet(sp.time, sp.blocks, sp.sparseness, sp.th_fun,
+                    sp.th_value, sp.patterns, file_out, w_file, sp.x_win, sp.rho);
+
+                Net.setNoiseProbe(probe);
+                Net.setWeightPrecision('d', true);
+                Net.networkInitialCodition(sp.np, init.get(ir, iir));
+                vector<double> ref_values = Net.updateNet(sp.time, sp.blocks, sp.sparseness, sp.th_fun,
+                    sp.th_value, sp.patterns, file_out, w_file, sp.x_win, sp.rho);
+
+                ProbeResult pr;
+                pr.ir = ir;
+                pr.m = output_values[0];
+                pr.t = (int)output_values[6];
+                pr.cycle = (int)output_values[7];
+                pr.dm = fabs(output_values[0] - ref_values[0]);
+                res.push_back(pr);
+            }
+        }
+        return res;
+    }
+
+    //Batched retrieval test, same results as the loop below (which traces the states)
+    if (sp.batch == true && in.trace == NULL) {
+        vector<int> probe_ir;
+        for (int ir=1;ir<=sp.patterns;ir++) {
+            for (int iir=6;iir<=sp.pat_int;iir++) {
+                Net.networkInitialCodition(sp.np, init.get(ir, iir));
+                Net.queueProbe();
+                probe_ir.push_back(ir);
+            }
+        }
+
+        vector< vector<double> > outputs = Net.updateNetBatch(sp.time, sp.blocks, sp.sparseness,
+            sp.th_fun, sp.th_value, sp.rho);
+
+        for (size_t i = 0; i < outputs.size(); i++) {
+            ProbeResult pr;
+            pr.ir = probe_ir[i];
+            pr.m = outputs[i][0];
+            pr.t = (int)outputs[i][6];
+            pr.cycle = (int)outputs[i][7];
+            pr.dm = 0.0;
+            res.push_back(pr);
+        }
+
+        return res;
+    }
+
+    // Retrieval test for patterns
+    for (int ir=1;ir<=sp.patterns;ir++) {
+
+        for (int iir=6;iir<=sp.pat_int;iir++) {
+
+            //Applies a network initial condition with np noise to the pattern from path2
+            Net.networkInitialCodition(sp.np, init.get(ir, iir));
+            Net.setTraceProbe(ir, iir);
+
+            /*
+            Perform network time update
+            for the given initial conditions and network parameters
+            */
+            vector<double> output_values = Net.updateNet(sp.time, sp.blocks, sp.sparseness, sp.th_fun,
+                sp.th_value, sp.patterns, file_out, w_file, sp.x_win, sp.rho);
+
+            ProbeResult pr;
+            pr.ir = ir;
+            pr.m = output_values[0];
+            pr.t = (int)output_values[6];
+            pr.cycle = (int)output_values[7];
+            pr.dm = 0.0;
+            res.push_back(pr);
+
+        }
+    }
+
+    return res;
+
+}
+
+void writeModuleResults(ResultSink & sink, const vector<ProbeResult> & res, bool cycles) {
+    for (size_t i = 0; i < res.size(); i++)
+        sink.write(res[i].ir, res[i].m, res[i].t, res[i].cycle, cycles);
+}
+
+void addAccuracy(AccuracyReport & acc, const vector<ProbeResult> & res, double tolerance) {
+    for (size_t i = 0; i < res.size(); i++) {
+        acc.probes++;
+        acc.above += res[i].dm > tolerance;
+        acc.max_dm = max(acc.max_dm, res[i].dm);
+        acc.sum_dm += res[i].dm;
+    }
+}
+
+vector<PatternId> learnedPatterns(const SimParams & sp, int ni) {
+    vector<PatternId> learned;
+    for (int il=0;il<sp.subsetSize;il++) {
+        for (int iil=6;iil<=sp.pat_int;iil++) {
+            PatternId pid;
+            pid.id = il+1+ni*sp.subsetSize;
+            pid.interval = iil;
+            learned.push_back(pid);
+        }
+    }
+    return learned;
+}
+
+void requestPatterns(const SimParams & sp, PatternBank & learn, PatternBank & init) {
+    for (int ni=0; ni<sp.nNets && sp.load_snapshot[0] == 0; ni++) {
+        vector<PatternId> learned = learnedPatterns(sp, ni);
+        for (size_t il=0;il<learned.size();il++)
+            learn.request(learned[il].id, learned[il].interval);
+    }
+    for (int ir=1;ir<=sp.patterns;ir++)
+        for (int iir=6;iir<=sp.pat_int;iir++)
+            init.request(ir, iir);
+}
+
+void runEnsemble(const SimParams & sp, const char * file_out) {
+
+    int threads = sp.threads < 1 ? ThreadPool::hardwareThreads() : sp.threads;
+
+    //Trained modules of a snapshot
+    SnapshotFile snapshot;
+    if (sp.load_snapshot[0] != 0) {
+        if (snapshot.open(sp.load_snapshot) == false) {
+            fprintf(stderr, "Invalid snapshot file %s\n", sp.load_snapshot);
+            exit(1);
+        }
+        const SnapshotHeader & h = snapshot.parameters();
+        if (h.neurons != sp.Neurons || h.neighbors != sp.Degree || h.rewiring != sp.rewProb
+            || h.topology != sp.topology) {
+            fprintf(stderr, "Snapshot %s holds N=%d K=%d w=%g top=%c modules\n", sp.load_snapshot,
+                h.neurons, h.neighbors, h.rewiring, h.topology);
+            exit(1);
+        }
+        for (int ni=0; ni<sp.nNets; ni++) {
+            if (snapshot.hasModule(ni) == false) {
+                fprintf(stderr, "Module %d is not in snapshot %s\n", ni, sp.load_snapshot);
+                exit(1);
+            }
+            //The module must hold the patterns this run would learn
+            vector<PatternId> learned = learnedPatterns(sp, ni);
+            vector<PatternId> stored = snapshot.learned(ni);
+            bool same = learned.size() == stored.size();
+            for (size_t il=0;il<learned.size() && same;il++)
+                same = learned[il].id == stored[il].id && learned[il].interval == stored[il].interval;
+            if (same == false) {
+                fprintf(stderr, "Module %d of snapshot %s learned other patterns (subsetSize, P or pi differ)\n",
+                    ni, sp.load_snapshot);
+                exit(1);
+            }
+        }
+    }
+
+    SnapshotWriter save;
+    if (sp.save_snapshot[0] != 0 && save.open(sp.save_snapshot, sp.Neurons, sp.Degree, sp.rewProb,
+        sp.width, sp.height, sp.topology) == false) {
+        fprintf(stderr, "Can not write snapshot file %s\n", sp.save_snapshot);
+        exit(1);
+    }
+
+    //Loads every pattern of the run once, path2 shares the bank when it is path1
+    PatternBank learn(sp.path1, sp.Neurons);
+    unique_ptr<PatternBank> init_bank;
+    if (strcmp(sp.path1, sp.path2) != 0)
+        init_bank.reset(new PatternBank(sp.path2, sp.Neurons));
+    PatternBank & init = init_bank ? *init_bank : learn;
+
+    unique_ptr<RunProfile> profile;
+    if (sp.profile[0] != 0)
+        profile.reset(new RunProfile());
+
+    StateTraceWriter trace;
+    if (sp.trace[0] != 0 && trace.open(sp.trace, sp.Neurons, sp.width, sp.height) == false) {
+        fprintf(stderr, "Can not write trace file %s\n", sp.trace);
+        exit(1);
+    }
+
+    requestPatterns(sp, learn, init);
+
+    PhaseTimer load(profile.get(), PHASE_LOAD);
+    learn.load(threads);
+    if (init_bank)
+        init.load(threads);
+    load.stop();
+
+    if (sp.verbose) {
+        printf("Seed: %llu\n", sp.seed);
+        learn.report("Learning patterns");
+        if (init_bank)
+            init.report("Initial state patterns");
+    }
+
+    SharedInputs in;
+    in.learn = &learn;
+    in.init = &init;
+    in.snapshot = sp.load_snapshot[0] != 0 ? &snapshot : NULL;
+    in.save = sp.save_snapshot[0] != 0 ? &save : NULL;
+    in.profile = profile.get();
+    in.trace = sp.trace[0] != 0 ? &trace : NULL;
+
+    runEnsemble(sp, file_out, in);
+
+    if (in.trace != NULL && trace.close() == false)
+        fprintf(stderr, "Can not write trace file %s\n", sp.trace);
+
+    if (in.save != NULL && save.close() == false) {
+        fprintf(stderr, "Can not write snapshot file %s\n", sp.save_snapshot);
+        exit(1);
+    }
+
+    if (profile && profile->writeJson(sp.profile, file_out) == false)
+        fprintf(stderr, "Can not write profile file %s\n", sp.profile);
+
+}
+
+void runEnsemble(const SimParams & sp, const char * file_out, const SharedInputs & in) {
+
+    //Results file (and .npy file) open for the whole run, written in module order
+    ResultSink sink;
+    string column_file = columnFileName(file_out);
+    if (sink.open(file_out, sp.npy ? column_file.c_str() : NULL) == false) {
+        fprintf(stderr, "Can not write results file %s\n", sp.npy ? column_file.c_str() : file_out);
+        exit(1);
+    }
+
+    runEnsembleModules(sp, file_out, in, [&](const vector<ProbeResult> & res) {
+        PhaseTimer output(in.profile, PHASE_OUTPUT);
+        writeModuleResults(sink, res, sp.cycles > 0);
+    });
+
+    if (sink.close() == false)
+        fprintf(stderr, "Can not write results file %s\n", file_out);
+
+}
+
+void runEnsembleModules(const SimParams & sp, const char * file_out, const SharedInputs & in,
+    const ModuleResults & out) {
+
+    int threads = sp.threads < 1 ? ThreadPool::hardwareThreads() : sp.threads;
+
+    AccuracyReport acc = {0, 0, 0.0, 0.0};
+
+    //Serial modules, all the threads go to the network update
+    if (threads == 1 || sp.nNets <= 1) {
+        for (int ni=0; ni<sp.nNets; ni++) {
+            vector<ProbeResult> res = runModule(sp, ni, threads, file_out, in);
+            addAccuracy(acc, res, sp.w_check);
+            out(res);
+        }
+    }
+    else {
+        runModules(sp, threads, file_out, in, acc, out);
+    }
+
+    if (sp.w_check > 0) {
+        int bytes = sp.weights == 'f' ? 4 : (sp.weights == 'i' ? 2 : 8);
+        printf("Weights %c (%d bytes/edge) vs double: %d probes, max |dm| %f, mean |dm| %f, %d above tolerance %g\n",
+            sp.weights, bytes, acc.probes, acc.max_dm, acc.probes > 0 ? acc.sum_dm / acc.probes : 0.0,
+            acc.above, sp.w_check);
+    }
+
+}
+
+void runModules(const SimParams & sp, int threads, const char * file_out,
+    const SharedInputs & in, AccuracyReport & acc, const ModuleResults & out) {
+
+    //Concurrent modules, remaining threads are split among the module networks
+    int workers = min(threads, sp.nNets);
+    int net_threads = max(1, threads / workers);
+
+    vector< vector<ProbeResult> > results(sp.nNets);
+    vector<bool> done(sp.nNets, false);
+    int next_write = 0; //First module not yet written
+    mutex write_mtx;
+
+    TaskPool modules(workers);
+    for (int ni=0; ni<sp.nNets; ni++) {
+        modules.submit([&, ni]() {
+            vector<ProbeResult> res = runModule(sp, ni, net_threads, file_out, in);
+
+            unique_lock<mutex> lock(write_mtx);
+            addAccuracy(acc, res, sp.w_check);
+            results[ni].swap(res);
+            done[ni] = true;
+            while (next_write < sp.nNets && done[next_write]) {
+                out(results[next_write]);
+                vector<ProbeResult>().swap(results[next_write]);
+                next_write++;
+            }
+        });
+    }
+    modules.wait();
+
+}
+
+#endif /*ENSEMBLE_H_*/
@@ -4,16 +4,56 @@
 #include <vector>
 #include <string.h>
 #include "network.h"
+#include "ensemble.h"
+#include "patternfile.h"
+#include "sweep.h"
 
 using namespace std;
 
 bool checkParameters(int); //Checks for parameter number
-string returnFileName(char *argv[]); //Generates output file name
-string returnFilePattern(int bS, int sS, char * ruta); //Returns input file pattern
+bool parseOptions(int argc, char *argv[], int first, SimParams & sp); //Reads the optional --flags after the parameters
 string returnOutFile(int bS, int sS); //Returns output file pattern
 
 int main(int argc, char *argv[])
 {
+	//Packs text patterns into a single pattern file
+	if (argc > 1 && strcmp(argv[1], "--pack") == 0) {
+		if (argc != 9) {
+			printf("Usage: ./sparsenet --pack path first last pi wth ht file\n");
+			return 1;
+		}
+		bool packed = packPatterns(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+			atoi(argv[6]), atoi(argv[7]), argv[8]);
+		return packed ? 0 : 1;
+	}
+
+	//Lists the probes of a state trace, or writes the state of one of its steps
+	if (argc > 1 && strcmp(argv[1], "--trace-state") == 0) {
+		if (argc == 3)
+			return listTrace(argv[2]) ? 0 : 1;
+		if (argc != 8) {
+			printf("Usage: ./sparsenet --trace-state trace_file [module pattern interval step out_file]\n");
+			return 1;
+		}
+		bool written = writeTraceState(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), atoi(argv[6]),
+			argv[7]);
+		return written ? 0 : 1;
+	}
+
+	//Runs the jobs of a parameter grid file
+	if (argc > 1 && strcmp(argv[1], "--sweep") == 0) {
+		if (argc < 3) {
+			printf("Usage: ./sparsenet --sweep grid_file [options]\n");
+			return 1;
+		}
+		SimParams options;
+		defaultOptions(options);
+		options.threads = 0; //A sweep runs on all hardware threads unless --threads n is given
+		if (parseOptions(argc, argv, 3, options) == false)
+			return 1;
+		return runSweep(argv[2], options) ? 0 : 1;
+	}
+
 	//Checking input parameters count
 	bool continuar = checkParameters(argc);
 
@@ -24,110 +64,16 @@ int main(int argc, char *argv[])
 		strcpy(file_out, returnFileName(argv).c_str());
 
 		//Assigning parameter values
-	    int Neurons = atoi(argv[1]); //Number of nodes in the network
-        int Degree = atoi(argv[2]); //K-neighbors per node
-        double rewProb = atof(argv[3]); //Rewiring Probability: Omega parameter
-        double sparseness = atof(argv[4]); //Sparseness (activity level) of the learning patterns
-        int blocks = atoi(argv[5]); //Number of blocks in the patterns
-        char th_fun = *argv[6]; //Threshold function
-        double th_value = atof(argv[7]); //Threshold value: theta0
-        double rho = atof(argv[8]); //Value of rho
-        double np = atof(argv[9]); //Noise applied to initial states m0=1-np
-        int time = atoi(argv[10]); //Time steps for network evolution
-        int iniPat = atoi(argv[11]); //Initial pattern
-        int patterns = atoi(argv[12]); //Final pattern
-        int pat_int = atoi(argv[13]); //pattern interval
-        int x_win = atoi(argv[14]); //x_win points (mxi_t): measures mesoscopic parameters in x-size windows
-        int width = atoi(argv[15]); //pattern width
-        int height = atoi(argv[16]); //pattern height
-        char topology = *argv[19]; //network topology
-        int subsetSize = atoi(argv[20]); //subnet size (K_b)
-        int nNets = atoi(argv[21]);  // number of subnets, nNets x subsetSize = patterns
-
-        FILE * oFile = fopen (file_out,"w");
-		fclose(oFile);
-
-        for (int ni=0; ni<nNets; ni++) {
-
-        	//Generating small-world network int *ptr; ptr=new int[size];
-    		Network Net(Neurons, Degree, rewProb, width, height, topology); //cout << "Red bien"; cin.get();
-    		/*
-    		Uncomment next line to printscreen the network topology
-            Notice that N=widthxheigt, i.e. Use: N=6x6=36, K=8, width=6, height=6
-            */
-            // Net.toString(); cin.get();
-
-            //Uncomment next line to printscreen adjacency matrix
-            //Net.toAdjMat(); cin.get();
-
-            /*
-            w_file = true prints simulation results for every time step
-            w_file = false prints simulation results for last time step
-            */
-    		bool w_file = false;
-
-            int p = 0; //Learned patterns counter
-
-            //Loop the set of patterns for learning and retrieve testing.
-            //Each step a new pattern is learned by the network,
-            //and right after initializing in a state with np noise
-            //the network evolves for the given time steps.
-            for (int il=0;il<subsetSize;il++) {
-
-                for (int iil=6;iil<=pat_int;iil++) {
-
-                    //Generating filename for learning patterns in path1
-                    char file_in[256];
-                    //strcpy(file_in, returnFilePattern(pS[il], iil, argv[17]).c_str());
-                    strcpy(file_in, returnFilePattern(il+1+ni*subsetSize, iil, argv[17]).c_str());
-
-                    //Read learning pattern file
-                    Net.loadPatternFile(file_in);
-
-                    //Hebb learning of file_in pattern
-                    Net.hebbLearning();
-
-                }
-
-            }
-
-            // Retrieval test for patterns
-            for (int ir=1;ir<=patterns;ir++) {
-
-                for (int iir=6;iir<=pat_int;iir++) {
-
-                    //Generating filename for intial network states in path2
-                    char file_in0[256];
-                    strcpy(file_in0, returnFilePattern(ir, iir, argv[18]).c_str());
-
-                    //Read intial state pattern
-                    Net.loadPatternFile(file_in0);
-
-                    //Applies a network initial condition with np noise
-                    Net.networkInitialCodition(np);
-
-                    /*
-                    Perform network time update
-                    for the given initial conditions and network parameters
-                    */
-                    vector<double> output_values = Net.updateNet(time, blocks, sparseness, th_fun,
-                        th_value, patterns, file_out, w_file, x_win, rho);
-
-
-                    oFile = fopen (file_out,"a");
-
-    		        fprintf(oFile,"%d, %f, %d\n", ir, 
-                        output_values[0],
-                        (int)output_values[6]);
-
-                    fclose(oFile);
-
-                    p++; //Increase patterns counter
+		SimParams sp;
+		readParameters(argv, sp);
 
-                }
-            }
+        //Optional flags
+        defaultOptions(sp);
+        if (parseOptions(argc, argv, 22, sp) == false)
+            return 1;
 
-        }
+        //Builds, trains and tests the modules, writing their results to file_out
+        runEnsemble(sp, file_out);
 
 	}
 	return 0;
@@ -135,7 +81,7 @@ int main(int argc, char *argv[])
 
 //Checks for parameter number and return some instructions if number is not OK
 bool checkParameters(int argc) {
-	if (argc < 20)
+	if (argc < 22)
     {
         printf("Usage: \n");
 	    printf("./sparsenet N K w a B T t rho np time p P pi x wth ht path1 path2 top subsetSize nNets\n");
@@ -155,11 +101,50 @@ bool checkParameters(int argc) {
 	    printf("x:           x points (mxi_t): measures mesoscopic parameters in x-size windows (Not used in fp)\n");
 	    printf("wth:         pattern width\n");
 	    printf("ht:          pattern height\n");
-	    printf("path1:       path to learning patterns folder (i.e. rolled fingerprints)\n");
-	    printf("path2:       path to initial state patterns folder (i.e. latent fingerprints)\n");
+	    printf("path1:       path to learning patterns folder (i.e. rolled fingerprints) or packed pattern file\n");
+	    printf("path2:       path to initial state patterns folder (i.e. latent fingerprints) or packed pattern file\n");
 	    printf("top:         network topology: s > er-sym, a > er-asym, r > ring, c > Cross-Grid, x > X-Grid, l > l-side SquareGrid\n");
         printf("subsetSize:  subset size for each module\n");
         printf("nNets:       number of modules, nNets x subsetSize = patterns\n");
+        printf("Options (after the parameters): \n");
+        printf("--threads n: threads of the run, 0 uses all hardware threads (default 1)\n");
+        printf("             modules run concurrently when nNets > 1, each network update gets the remaining threads\n");
+        printf("--batch:     evolves up to 64 initial states together in each pass over the network\n");
+        printf("--delta:     event-driven update, each step evaluates only the nodes with a flipped neighbor\n");
+        printf("             (same results, faster once few nodes change; not used with --batch)\n");
+        printf("--cycles L:  also stops an initial state at a fixed point or cycle of period up to L\n");
+        printf("             (exact repetition of the network state) and writes the period as a 4th column\n");
+        printf("--implicit:  ring, cross and X grids (r, c, x) compute the lattice neighbors of a node instead of\n");
+        printf("             storing them and keep only the rewired edges (same results, less memory for small w)\n");
+        printf("--renumber:  renumbers the nodes of every trained module in reverse Cuthill-McKee order, so\n");
+        printf("             neighbors are close in the state vectors (same results; not used with --implicit)\n");
+        printf("--verbose:   prints run information (patterns loaded, memory, load time)\n");
+        printf("--weights p: weight precision of the network update: d > double (default), f > float, i > int16 fixed point\n");
+        printf("--weights-check tol: runs every initial state also with double weights from the same noise\n");
+        printf("             and reports the differences of m against the tolerance tol (i.e. 0.01)\n");
+        printf("--save-snapshot file: writes the trained modules (topology, weights, learned patterns) to file\n");
+        printf("--load-snapshot file: retrieval only, the modules are mapped from a snapshot of the same N K w top\n");
+        printf("             instead of being built and trained (path1 is not read)\n");
+        printf("--seed n:    seed of the random numbers (rewiring, noise), default the clock; a run with the\n");
+        printf("             same seed and parameters gives the same results with any number of threads\n");
+        printf("--profile file: writes the run profile as JSON to file: time of each phase (construct, learn,\n");
+        printf("             load, retrieve, output), steps histogram, mean flips per step, peak memory\n");
+        printf("--npy:       also writes the results as a NumPy record array (ir, m, t, cycle) to the result file\n");
+        printf("             name with extension .npy, readable with numpy.load(file, mmap_mode='r')\n");
+        printf("--trace file: records the network state of every time step of every initial state to file,\n");
+        printf("             XOR delta coded against the previous step (initial states run one at a time)\n");
+        printf("Parameter sweep: \n");
+        printf("./sparsenet --sweep grid_file [options]\n");
+        printf("             runs every combination of the parameter lists of grid_file (see sweep_example.cfg)\n");
+        printf("             on all hardware threads (or --threads n), writing the usual result file of each one\n");
+        printf("--workers n: runs the jobs on n forked worker processes sharing the patterns and a result table,\n");
+        printf("             the threads are split among them; the job of a worker that dies is run again\n");
+        printf("Packing patterns: \n");
+        printf("./sparsenet --pack path first last pi wth ht file\n");
+        printf("             writes the patterns first_6..last_pi of folder path to a packed pattern file\n");
+        printf("Reading a state trace: \n");
+        printf("./sparsenet --trace-state file [module pattern interval step out_file]\n");
+        printf("             lists the traced initial states, or writes the state of a step as 0/1 per node\n");
 	    printf("Examples: \n");
         printf("single: ./sparsenet 89420 240 0.5 0.2258 1 r 0.656 0.7 0.0 100 1 10 6 100 263 340 patterns/ patterns/ c 10 1\n");
         printf("ensemble: ./sparsenet 89420 24 1 0.2258 1 r 0.656 0.7 0.0 100 1 100 6 100 263 340 patterns/ patterns/ c 10 10\n\n");
@@ -171,60 +156,63 @@ bool checkParameters(int argc) {
 	}
 }
 
-/*
-Returns the filename for the output text file using the input parameters
-*/
-string returnFileName(char *argv[]) {
-
-    char * pch;
-    char * ruta;
-    char str0[256];
-    strcpy (str0,argv[18]);
-    pch = strtok (str0,"/");
-    while (pch != NULL)
-    {
-        ruta = pch;
-        pch = strtok (NULL, "/");
+//Reads the optional --flags following the positional parameters
+bool parseOptions(int argc, char *argv[], int first, SimParams & sp) {
+    for (int i = first; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            sp.threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--batch") == 0) {
+            sp.batch = true;
+        }
+        else if (strcmp(argv[i], "--cycles") == 0 && i+1 < argc) {
+            sp.cycles = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--delta") == 0) {
+            sp.delta = true;
+        }
+        else if (strcmp(argv[i], "--implicit") == 0) {
+            sp.implicit = true;
+        }
+        else if (strcmp(argv[i], "--renumber") == 0) {
+            sp.renumber = true;
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i+1 < argc) {
+            strcpy(sp.profile, argv[++i]);
+        }
+        else if (strcmp(argv[i], "--npy") == 0) {
+            sp.npy = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+            strcpy(sp.trace, argv[++i]);
+        }
+        else if (strcmp(argv[i], "--workers") == 0 && i+1 < argc) {
+            sp.workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--verbose") == 0) {
+            sp.verbose = true;
+        }
+        else if (strcmp(argv[i], "--weights") == 0 && i+1 < argc && strchr("dfi", *argv[i+1]) != NULL) {
+            sp.weights = *argv[++i];
+        }
+        else if (strcmp(argv[i], "--weights-check") == 0 && i+1 < argc) {
+            sp.w_check = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--save-snapshot") == 0 && i+1 < argc) {
+            strcpy(sp.save_snapshot, argv[++i]);
+        }
+        else if (strcmp(argv[i], "--load-snapshot") == 0 && i+1 < argc) {
+            strcpy(sp.load_snapshot, argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i+1 < argc) {
+            sp.seed = strtoull(argv[++i], NULL, 10);
+        }
+        else {
+            printf("Unknown option: %s\n", argv[i]);
+            return false;
+        }
     }
-
-    ostringstream outputFile;
-
-	outputFile << "N"
-	<< argv[1]
-    << "K" << argv[2]
-    << "w" << argv[3]
-    << "a" << argv[4]
-    << "b" << argv[5]
-    << "T" << argv[6]
-    << "t" << argv[7]
-    << "rho" << argv[8]
-    << "np" << argv[9]
-    << "time" << argv[10]
-    << "p" << argv[11]
-    << "P" << argv[12]
-    << "pi" << argv[13]
-    << "x" << argv[14]
-    << "w" << argv[15]
-    << "h" << argv[16]
-    << "TY" << argv[19]
-    << "SNS" << argv[20]
-    << "NN" << argv[21]
-    << "PW" << ruta << ".txt";
-
-    return outputFile.str();
-
-}
-
-//Returns input pattern filename in the specified path (ruta)
-string returnFilePattern(int bS, int sS, char * ruta) {
-
-        ostringstream inputFile;
-
-        inputFile << ruta;
-        inputFile << bS << '_' << sS;
-
-        return inputFile.str();
-
+    return true;
 }
 
 //Returns output pattern filename in local directory
@@ -9,62 +9,484 @@
 #include <vector>
 #include <math.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <iostream>
+#include <algorithm>
+#include <memory>
+#include "bitstate.h"
+#include "threadpool.h"
+#include "rng.h"
+#include "profile.h"
+#include "resultsink.h"
+#include "statetrace.h"
 
 using namespace std;
 
+//Neurons per chunk of the parallel sweeps, a multiple of 512 bits so chunks own whole cache lines of the packed states
+#define SWEEP_CHUNK 4096
+
+//Per-step constants of the threshold functions
+struct StepParams {
+    char th_fun; //Threshold function
+    double sparseness;
+    double th_value; //Threshold value: theta0
+    double slope; //Slope of the linear threshold function
+    double global_activity; //Network activity before the step
+    double rho1; //Value of rho for the step
+};
+
+/*
+Per-step values of every active neighbor count c (0 .. longest row): the local
+activity c/K, its std dev and the node threshold, so the update of a node looks
+them up instead of evaluating sqrt and the threshold function. The std dev is
+stored (not its inverse) so the neural field is divided exactly as before
+*/
+struct StepTable {
+    vector<double> activity; //Local activity c/K
+    vector<double> sd; //Std dev of the local activity
+    vector<double> th; //Node threshold
+};
+
+/*
+Block sums of the overlap statistics, kept on the network so a step allocates
+nothing. The covered nodes (bn blocks of neurons/bn) are cut into segments at
+chunk and block boundaries; each chunk of the sweep fills the sums of its own
+segments and the segments are reduced in node order, so the sums do not depend
+on the number of threads or on which pass computed them
+*/
+struct BlockSums {
+    int bn; //Blocks the segments are cut for (0: not built)
+    vector<int> seg_first; //First segment of each chunk, size chunks+1
+    vector<int> seg_block; //Block of each segment
+    vector<int> seg_a, seg_b; //Nodes [seg_a, seg_b) of each segment
+    vector<int> s1, s2, s12; //Active counts of each state and co-active count of each segment
+    vector<double> sth; //Threshold sum of each segment
+    vector<int> n1, n2, n12; //Sums of each block
+    vector<double> th_sum;
+
+    BlockSums() : bn(0) {}
+};
+
+/*
+Neighbors of the node being rewired, for the duplicate checks: a count per node
+id, so a check is a single load instead of a scan of the row. Counts (not flags)
+keep a lattice row with a repeated neighbor (tiny networks) behaving as the row
+does. The set is emptied by erasing the row it was filled with, so one set
+serves all the rows of a chunk.
+*/
+class NodeSet {
+private:
+    vector<int> counts; //times each node is in the row
+
+public:
+    NodeSet(int neurons) : counts(neurons, 0) {}
+
+    bool contains(int v) const { return counts[v] > 0; }
+    void insert(int v) { counts[v]++; }
+    void erase(int v) { counts[v]--; }
+};
+
+//Read-only topology and weights of a trained network, in the CSR layout of Network
+struct NetworkArrays {
+    int neurons; //number of neurons
+    int neighbors; //number of neighbors (network degree)
+    double rewiring; //small-world rewiring probability
+    const int * row_off; //neurons+1 row offsets
+    const int * adj; //row_off[neurons] neighbors
+    const double * w; //row_off[neurons] weights
+};
+
 class Network {
 private:
 	int neurons; //number of neurons
 	int neighbors; //number of neighbors (network degree)
 	double rewiring; //small-world rewiring probability
-    vector< vector<int> > C; //Adjacency matrix
-	vector< vector<double> > W; //Weigth matrix
+	/*
+	Topology and weights are stored as a flat CSR adjacency list:
+	the neighbors of node n are C[C_off[n]] .. C[C_off[n+1]-1]
+	and W holds the weight of each of those edges at the same position
+	*/
+	vector<int> C_off; //Row offsets of the adjacency list, size neurons+1
+	vector<int> C; //Adjacency list
+	vector<double> W; //Weigth matrix
+	/*
+	Weight precision of the update kernels: d double, f float, i int16 fixed point.
+	Learning always accumulates in W; the first update converts W once to W_f or
+	W_i (W = W_i*w_scale) and releases it unless w_keep is set, the next learning
+	restores it from the reduced weights.
+	*/
+	char w_precision;
+	bool w_packed; //W has been converted to the reduced weights
+	bool w_keep; //Keeps W alongside the reduced weights
+	vector<float> W_f; //float weights
+	vector<int16_t> W_i; //int16 fixed point weights
+	double w_scale; //Weight of one int16 unit
+	/*
+	Edge arrays read by the update kernels: C_off, C and W, or the arrays of a
+	read-only trained network (i.e. a snapshot mapping) when mapped is set,
+	which are copied to C_off, C and W before anything modifies them
+	*/
+	const int * off_p;
+	const int * adj_p;
+	const double * w_p;
+	bool mapped;
+	/*
+	Implicit lattice (setImplicitTopology): the unrewired neighbors of the ring,
+	cross and X grids are computed from the node number by the generators, C is
+	released and only the rewired edges are kept, as (position in the row, node)
+	pairs of every row n from ov_off[n]
+	*/
+	char lattice; //Topology generating the rows (0: C holds the adjacency)
+	char topology_type; //Topology of the constructor (0: unknown, i.e. a mapped network)
+	int grid_width; //Pattern width of the cross and X grids
+	vector<int> ov_off; //Row offsets of the overlay, size neurons+1
+	vector<uint16_t> ov_pos; //Position of a rewired edge in its row
+	vector<int> ov_node; //Node of a rewired edge
+	void latticeRow(int n, int * Cn); //Unrewired row of node n
+	//Adjacency row of node n: in C, or generated in buf (max_row ints) for an implicit lattice
+	inline const int * row(int n, int * buf);
+	void expandTopology(); //Rebuilds C from the implicit lattice
+	/*
+	Tiled sweeps of the cross, X and square grids: the lattice neighbors of a node
+	are up to tile_reach image rows (of grid_width nodes) away, so the sweeps visit
+	the rows of a chunk in tiles of columns whose halo fits in L2, instead of whole
+	image rows. Each node is still computed from the previous state alone (and each
+	weight from its own edge), so the order does not change any result
+	*/
+	int tile_reach; //Rows and columns of the lattice neighbors (0: no tiling)
+	int tile_set; //Tile width of setTileWidth (0: from the L2 size, -1: row-major)
+	//Columns of the tiles of rows image rows with node_bytes per node (0: row-major)
+	int tileWidth(double node_bytes, int rows) const;
+	//Calls f(a, b) for the runs of nodes [n0, n1) in tiles of tw columns (tw 0: one run)
+	template <class F>
+	void tiledRuns(int n0, int n1, int tw, F f) const;
+	/*
+	Node renumbering (renumberNodes): node n of the network is node old_id[n] of
+	the patterns, noise streams, traces and statistics, node i of those is node
+	new_id[i] of the network (both empty: original numbering). Patterns are
+	renumbered on the way in and states on the way out, the rows keep the order
+	of their neighbors and the statistics are summed in the original node order,
+	so every result is the one of the original numbering
+	*/
+	vector<int> old_id;
+	vector<int> new_id;
+	BitState perm_buf; //Pattern or state in the other numbering
+	void permuteNodes(const vector<int> & to); //Moves node n of the network to to[n]
+	vector<int> rcmOrder(); //Reverse Cuthill-McKee position of every node
+	//pattern in the network numbering, renumbered into buf when the nodes are renumbered
+	const uint64_t * networkOrder(const uint64_t * pattern, BitState & buf);
+	void syncViews(); //Points the edge arrays to C_off, C and W
+	void detach(); //Copies mapped edge arrays to C_off, C and W
+	void initState(); //Weight settings, states, thresholds and threads of a new network
+	uint64_t rng_seed; //Run seed of the random streams
+	int rng_module; //Module of the network, part of the key of its streams
+	uint64_t noise_probe; //Noise stream of the next noisy initial condition
+	RandomStream rng_net; //Stream of unifRand
 	vector<double> TH; //Threshold_i
-	vector<bool> V_t; //Network state in time t
-	vector<bool> V_o; //Network state for pattern hebb learning
+	BitState V_t; //Network state in time t
+	BitState V_tp; //Network state in time t-1, swapped with V_t by the update sweep
+	BitState md_prev; //State of the previous statistics of updateNet, for the stop criterion
+	BitState V_o; //Network state for pattern hebb learning
 	double THETA_0; //value of Theta_0 for all patterns
+	unique_ptr<ThreadPool> pool; //Threads for the update sweep and the overlap sums
+
+	//Updates nodes [n0, n1) from the packed previous state vp with the step table tab
+	void updateRange(int n0, int n1, const uint64_t * vp, const StepTable & tab, int tw);
+
+	//updateRange kernel for weights Wv of type Wt, the neural field is scaled by scale
+	template <class Wt>
+	void updateRangeT(int n0, int n1, const uint64_t * vp, const StepTable & tab,
+        const Wt * Wv, double scale, int tw);
+
+	int max_row; //Longest adjacency row, last index of the step tables
+	StepTable step_tab; //Step table of updateNet
+
+	//Fills tab for the step parameters sp, with one specialized loop per threshold function
+	void buildStepTable(const StepParams & sp, StepTable & tab);
+
+	/*
+	Event-driven update (setDeltaUpdate). rev_node and rev_edge list, for every
+	node j from rev_off[j], the nodes reading j and the edge they read it by.
+	Every node keeps its active neighbor count d_count and weighted input sum
+	d_sum, updated from the flips of each step, so a step evaluates only the
+	nodes whose inputs (or threshold parameters) changed in O(1) each
+	*/
+	bool delta;
+	int cycle_window; //States checked for a repetition by updateNet (0: no cycle detection)
+	RunProfile * profile; //Receives the steps and flips of every probe (NULL: no profiling)
+	vector<int> step_flips; //Flips of every step of the probe being updated, for the profile
+	StateTraceWriter * trace; //Receives the state of every step of the traced probes (NULL: no trace)
+	int trace_module; //Module of the network in the trace
+	int trace_pattern; //Probe of the next updateNet, pattern and interval (0: not traced)
+	int trace_interval;
+	BitState trace_prev; //State of the previous traced step
+	string trace_rec; //Record of the traced step
+
+	//Appends the state of step t (V_tp) to the trace
+	void traceStep(int t);
+	vector<int> rev_off; //Row offsets of the reverse adjacency, size neurons+1
+	vector<int> rev_node; //Node reading node j
+	vector<int> rev_edge; //Edge of that node reading j
+	vector<int> d_count; //Active neighbors of each node
+	vector<double> d_sum; //sum_k W_k*V_k of each node
+	vector<double> d_wsum; //sum_k W_k of each node
+	vector<double> d_abs; //sum_k |W_k| of each node, bounds the rounding of d_sum
+	vector<int> d_dirty; //Nodes to evaluate in the next step
+	vector<char> d_mark; //Nodes already in d_dirty
+	vector<int> d_flips; //Nodes flipped by the step
+
+	void buildReverse(); //Builds the reverse adjacency of the topology
+
+	//Counts and sums of every node from the packed state vs
+	template <class Wt>
+	void deltaInit(const uint64_t * vs, const Wt * Wv, double scale);
+
+	/*
+	Delta step from the previous state vp (V_t holds vp): evaluates every node (all)
+	or the dirty ones, pushes the flips to the nodes reading them and returns the
+	number of flips; active gets the change of active nodes. steps is the number of
+	steps since deltaInit, which bounds the rounding error of d_sum
+	*/
+	template <class Wt>
+	int deltaStepT(const uint64_t * vp, const StepTable & tab, bool all, int steps, int & active,
+        const Wt * Wv, double scale);
+	void deltaInitState(const uint64_t * vs);
+	int deltaStep(const uint64_t * vp, const StepTable & tab, bool all, int steps, int & active);
+
+	//Converts W to the weight precision before an update, restores it before learning
+	void packWeights();
+	void unpackWeights();
+
+	/*
+	New state of a node with count active neighbors (not 0) and
+	neural_field = sum_k W_k*(V_k - local_activity); th gets the node threshold
+	*/
+	inline bool nodeFires(int count, double neural_field, const StepTable & tab, double & th);
+
+	//Batched retrieval queue: patterns and initial states of the queued probes
+	vector<BitState> batch_V_o;
+	vector<BitState> batch_V_t;
+
+	//Evolves up to 64 queued probes at once, one bit per probe in each state word
+	template <class Wt>
+	void updateBatch64(int first, int nprobes, int s_time, int blocks, const StepParams & sp0,
+        double rho, vector< vector<double> > & out, const Wt * Wv, double scale);
+
+	BlockSums md_sums; //Block sums of the statistics of updateNet and mdCalculate
+	BlockSums win_sums; //Block sums of mdCalculateWin
+	vector<double> win_overlap; //Block overlaps returned by mdCalculateWin
+
+	//Cuts the segments of bs for bn blocks, unless they are already cut for bn
+	void blockSegments(int bn, BlockSums & bs);
+
+	//Sums of the segments of sweep chunk c
+	void chunkSums(BlockSums & bs, int c, const BitState & V_in1, const BitState & V_in2, bool with_th);
+
+	//Adds the segment sums into the block sums, in node order
+	void reduceSums(BlockSums & bs);
+
+	/*
+	Active counts (n1, n2), co-active count n12 and threshold sum of each of the bn blocks,
+	computed over chunks in parallel and reduced in neuron order
+	*/
+	void blockSums(int bn, const BitState &, const BitState &, bool with_th, BlockSums & bs);
 
 public:
-	//Constructors
-	Network(int nN, int nK, double rP, int width, int height, char topology);
-	//Functions for topology matrix generation
-	void swRingGenerator(int); //Generates a Small-world Ring Topology Matrix
-    void erSymGenerator(int); //Generates a Erdos-Renyi Topology Matrix
-	void swSquareGridGenerator(int, int, int, int, int); //Generates a Square-Grid Topology Matrix
-	void swXGridGenerator(int, int); //Generates a Small-world X-Grid Topology Matrix
-	void swCrossGridGenerator(int, int); //Generates a Small-world Cross-Grid Topology Matrix
-	void swRewiring(int); //Rewires the connectivity adjacency list of the input node with the network rewiring probability
+	/*
+	Constructors, the topology is generated by nthreads threads (0: all hardware threads).
+	seed and module key the random streams of the network, so a network and its
+	noisy initial conditions are the same for the same seed and module
+	*/
+	Network(int nN, int nK, double rP, int width, int height, char topology, int nthreads = 1,
+        uint64_t seed = 0, int module = 0);
+
+	//Network over the arrays of a trained network, read in place, they must outlive it
+	Network(const NetworkArrays &, uint64_t seed = 0, int module = 0);
+
+	//Topology and double weights of the network, valid until it is modified
+	NetworkArrays arrays();
+
+	//Sets the number of threads of the update sweep (0: all hardware threads)
+	void setThreads(int);
+	int threads() const;
+
+	/*
+	Sets the weight precision of the updates: d double, f float, i int16 fixed point.
+	keep_double keeps the learned double weights, so the precision can be switched
+	back and forth without loss (i.e. to compare against the double reference)
+	*/
+	void setWeightPrecision(char precision, bool keep_double = false);
+	char weightPrecision() const { return w_precision; }
+
+	//Bytes per edge of the weights used by the updates
+	int weightBytes() const;
+
+	/*
+	Stores the ring, cross or X grid topology as an implicit lattice plus the rewired
+	edges (true), or as the explicit adjacency list (false). Updates and learning give
+	the same results; other topologies and mapped networks keep the adjacency list
+	*/
+	void setImplicitTopology(bool);
+	bool implicitTopology() const { return lattice != 0; }
+
+	/*
+	Renumbers the nodes in reverse Cuthill-McKee order of the symmetrized topology,
+	which keeps neighbors close in the states, so the gathers of the update touch
+	fewer cache lines. The order is kept only when it lowers the mean neighbor
+	distance. Updates, learning, traces and statistics give the same results;
+	implicit lattices are expanded first. arrays() restores the original numbering
+	*/
+	void renumberNodes();
+	void restoreNumbering();
+	bool renumbered() const { return old_id.empty() == false; }
+
+	//Mean |n - m| over the edges n->m in the current numbering
+	double neighborDistance() const;
+
+	//Bytes used by the adjacency (row offsets and explicit neighbors or overlay)
+	size_t topologyBytes() const;
+
+	/*
+	Tile width in columns of the tiled sweeps of the grid topologies:
+	0 picks it from the L2 cache size, -1 sweeps whole rows
+	*/
+	void setTileWidth(int columns) { tile_set = columns; }
+
+	//Number of edges (directed connections) of the network
+	int edges() const { return off_p[neurons]; }
+
+	/*
+	Sets the event-driven update of updateNet: after a full first step only the
+	nodes with a flipped neighbor (or all of them when the threshold parameters
+	of the step change) are evaluated, from running counts and weighted sums.
+	Nodes too close to their threshold for the rounding of the running sums are
+	recomputed as in the synchronous sweep, so trajectories are the same.
+	Needs a reverse adjacency list (4+4 bytes per edge)
+	*/
+	void setDeltaUpdate(bool);
+	bool deltaUpdate() const { return delta; }
+
+	/*
+	Sets the cycle detection of updateNet and updateNetBatch: the evolution also stops
+	when the state repeats one of the last window states (0: off) once the threshold
+	parameters no longer change (from step 20 for the rho and sine functions), and
+	the period of the cycle (1 for a fixed point, 0 for none) follows the last time step
+	*/
+	void setCycleWindow(int window) { cycle_window = window; }
+	int cycleWindow() const { return cycle_window; }
+
+	/*
+	Records the steps of every probe of updateNet and updateNetBatch, and the
+	flips of every step of updateNet, into profile (NULL: off)
+	*/
+	void setProfile(RunProfile * p) { profile = p; }
+
+	/*
+	Records the state of every step of updateNet into trace as module (NULL: off),
+	for the probes named with setTraceProbe. Batched retrieval is not traced
+	*/
+	void setTrace(StateTraceWriter * t, int module) { trace = t; trace_module = module; }
+
+	//Traces the next updateNet as the probe of pattern and interval
+	void setTraceProbe(int pattern, int interval) { trace_pattern = pattern; trace_interval = interval; }
+
+	//Bytes currently used by the topology, weight and state structures
+	MemoryUse memoryUse() const;
+	/*
+	Functions for topology matrix generation, each one fills the preallocated adjacency
+	row Ci of a node, so rows are generated in parallel
+	*/
+	void swRingGenerator(int, int *); //Generates a Small-world Ring Topology Matrix
+    void erSymGenerator(int, int *); //Generates a Erdos-Renyi Topology Matrix
+	int swSquareGridGenerator(int, int, int, int, int, int *); //Generates a Square-Grid Topology Matrix, returns the row size (only counted for a NULL row), at most K
+	void swXGridGenerator(int, int, int *); //Generates a Small-world X-Grid Topology Matrix
+	void swCrossGridGenerator(int, int, int *); //Generates a Small-world Cross-Grid Topology Matrix
+	//Rewires the connectivity adjacency list of the input node with the network rewiring probability,
+	//from the random stream of the node and with set as scratch for the duplicate checks
+	void swRewiring(int, NodeSet & set);
 
     //Reads pattern from file
 	void loadPatternFile(char *);
 
+	//Copies a packed pattern (neurons bits in 64-bit words, as in BitState)
+	void loadPattern(const uint64_t *);
+
 	//Sets network initial condition
 	void networkInitialCodition();
 
-	//Sets network initial condition with the inpput noise value
+	//Sets network initial condition with the inpput noise value, from the noise stream of the next probe
 	void networkInitialCodition(double);
 
+	//Noise stream of the next noisy initial condition, set it back to repeat the same noise
+	uint64_t noiseProbe() const { return noise_probe; }
+	void setNoiseProbe(uint64_t probe) { noise_probe = probe; }
+
+	//Loads a packed pattern (i.e. a PatternBank view) and sets the initial condition with noise
+	void networkInitialCodition(double, const uint64_t *);
+
 	//Performs HEBB learning rule
 	void hebbLearning();
 
+	//Performs HEBB learning of a packed pattern, read in place (i.e. a PatternBank view)
+	void hebbLearning(const uint64_t *);
+
+	/*
+	Performs HEBB learning of a set of packed patterns in a single pass over the edges,
+	with the same weights as calling hebbLearning for each of them
+	*/
+	void hebbLearningBatch(const vector<const uint64_t *> & patterns);
+
 	/*
 	Perform network time update
-    for the given initial conditions and network parameters
+    for the given initial conditions and network parameters,
+    returns m, d, q_m, q_d, th_m, th_d, the last time step and the cycle period
 	*/
 	vector<double> updateNet(int time, int blocks, double sparseness, char th_fun,
         double th_value, int pat, const char * file_name, bool w_filename, int x_win, double rho);
 
+	/*
+	Batched retrieval: queueProbe() stores the loaded pattern and the current initial
+	state, updateNetBatch() evolves all the queued probes, 64 per pass over the
+	topology and weights, and returns for each one the values updateNet returns
+	(threshold statistics are not tracked and left at 0)
+	*/
+	void queueProbe();
+	vector< vector<double> > updateNetBatch(int time, int blocks, double sparseness, char th_fun,
+        double th_value, double rho);
+
 	/*
 	Performs the calculation of the overlap between a network state and a learned pattern
 	*/
-	vector<double> mdCalculate(int, double, vector<bool> &, vector<bool> &);
+	vector<double> mdCalculate(int, double, BitState &, BitState &);
+
+	//Overlap, activity and threshold statistics (m, d, q_m, q_d, th_m, th_d) from the block sums of bs
+	void mdFromSums(const BlockSums & bs, double * md);
+
+	/*
+	m, d, q_m and q_d of md with the block overlaps summed node by node in node order, as
+	the original loop: its rounding depends on where the active nodes are, so two states
+	with the same block counts (same mdFromSums values) may still differ in the last bits
+	*/
+	void mdExact(int bn, const BitState & V_in1, const BitState & V_in2, double * md);
+
+	/*
+	Stop criterion of step t from the popcount statistics, decided by mdExact of both
+	states when they are equal for different states
+	*/
+	bool mdStop(int bn, const BitState & V_in1, const BitState & prev, const BitState & cur,
+	    vector<double> & md_prev, vector<double> & md_t);
 
 	/*
 	Performs the calculation of the intra-overlap between a network state and a learned pattern
 	for a given windows size
 	*/
-	vector<double> mdCalculateWin(int, double, vector<bool> &, vector<bool> &);
+	const vector<double> & mdCalculateWin(int, double, BitState &, BitState &);
+
+	/*
+	Sum of (x1-q1)*(x2-q2) over a block of L neurons given the active counts
+	n1, n2 and the count n12 of neurons active in both states
+	*/
+	double blockOverlap(int n1, int n2, int n12, int L, double q1, double q2);
 
 	/*
 	Compares overlaps and activity values between the network state and the pattern
@@ -88,10 +510,13 @@ public:
 	//Print main network parameters and the topology adjacency list to screen
     void toString();
 
-    //Random seed initialization
+    //Random seed initialization from the clock
     void seed();
 
-    // return a uniform number in [0,1].
+    //Seeds the random streams with the run seed and the module of the network
+    void seed(uint64_t seed, int module);
+
+    // return a uniform number in [0,1).
 	double unifRand();
 
 	//Threshold functions
@@ -110,10 +535,13 @@ public:
     Calculates the mean activity of the input vector
     Use to calculate the activity of patterns and network states
     */
-    double vectorMean(vector<bool> &);
+    double vectorMean(BitState &);
+
+    //Mean activity of a packed pattern of neurons bits
+    double patternMean(const uint64_t *);
 
     //Print the time evolution of the overlap to a text file
-    void mdtimeEvolution(int, double, vector<double> &, const char *);
+    void mdtimeEvolution(int, double, vector<double> &, BufferedFile &);
 
     //Print to screen the topology adjacency matrix to screen
     void toAdjMat();
@@ -136,66 +564,562 @@ width: pattern width
 height: pattern height
 Network topology. r: Ring, x: X-Grid, c: Cross-Grid, l: Circle-Grid
 */
-Network::Network(int nN, int nK, double rP, int width, int height, char topology) {
+Network::Network(int nN, int nK, double rP, int width, int height, char topology, int nthreads,
+    uint64_t seed_value, int module) {
 
     //Random seed initialization
-	seed();
+	seed(seed_value, module);
 
 	//Setting network parameters;
     neurons=nN;
     neighbors=nK;
     rewiring=rP;
 
-    //Reserving Topology(C) and Weight(W) vectors capacity
-	//C.reserve(neurons);
-	//W.reserve(neurons);
-	//V_t.reserve(neurons); //Network state in time t
-	//V_o.reserve(neurons); //Network state in hebb learning phase
-	//TH.reserve(neurons); //Neurons' threshold
-
-	for (int n = 0; n < neurons; n++) {
-	    //printf("Generating network......%d\r", n);
-	    //C[n].reserve(neighbors);
-	    //W[n].reserve(neighbors);
-	    switch(topology) {
-            case 'r':
-                swRingGenerator(n);
-            break;
-            case 'x':
-                swXGridGenerator(n, width);
-            break;
-            case 'c':
-                swCrossGridGenerator(n, width);
-            break;
-            case 's':
-                erSymGenerator(n);
-            break;
-            default:
-            break;
+    pool.reset(new ThreadPool(nthreads));
+    topology_type = topology;
+    grid_width = width;
+    tile_reach = (topology == 'c' || topology == 'x') ? neighbors/4 : 0;
+
+    //Rows are allocated up front: every topology has a fixed row size but the square
+    //grid, whose rows (in (i, j) grid order, at most K entries) are counted first
+    int row_size = 0;
+    int lSide = 0;
+    switch(topology) {
+        case 'r':
+            row_size = 2*(neighbors/2);
+        break;
+        case 'x':
+        case 'c':
+            row_size = 4*(neighbors/4);
+        break;
+        case 's':
+            row_size = neighbors;
+        break;
+        case 'l':
+            lSide = (sqrt(neighbors+1)-1)/2;
+            row_size = (2*lSide+1)*(2*lSide+1);
+            tile_reach = lSide;
+        break;
+        default:
+        break;
+    }
+
+    //Nodes past the square grid get empty rows
+    int grid_rows = topology == 'l' ? min(neurons, width*height) : neurons;
+    C_off.assign(neurons+1, 0);
+    for (int n = 0; n < neurons; n++) {
+        int kn = n < grid_rows ? row_size : 0;
+        if (topology == 'l' && n < grid_rows)
+            kn = swSquareGridGenerator(n / height, n % height, width, height, lSide, NULL);
+        C_off[n+1] = C_off[n] + kn;
+    }
+    C.resize(C_off[neurons]);
+
+    //Rows are independent: each chunk generates and rewires its own rows
+    int nchunks = (neurons + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+    pool->parallelFor(nchunks, [&](int c) {
+        int n0 = c * SWEEP_CHUNK;
+        int n1 = min(grid_rows, n0 + SWEEP_CHUNK);
+        NodeSet set(neurons);
+        for (int n = n0; n < n1; n++) {
+            int * Cn = C.data() + C_off[n];
+            switch(topology) {
+                case 'r':
+                    swRingGenerator(n, Cn);
+                break;
+                case 'x':
+                    swXGridGenerator(n, width, Cn);
+                break;
+                case 'c':
+                    swCrossGridGenerator(n, width, Cn);
+                break;
+                case 's':
+                    erSymGenerator(n, Cn);
+                break;
+                case 'l':
+                    swSquareGridGenerator(n / height, n % height, width, height, lSide, Cn);
+                break;
+                default:
+                break;
+            }
+
+            //Rewiring connectivity (not for the erdos-renyi topology)
+            if (rewiring > 0.0 && topology != 's')
+                swRewiring(n, set);
         }
+    });
 
-        V_o.push_back(0);
-        V_t.push_back(0);
-        TH.push_back(0);
+	W.assign(C.size(), 0.0); //Weight matrix, one weight per edge
+	mapped = false;
+	syncViews();
 
-	}
+	initState();
+
+}
 
-	if (topology == 'l') {
-	    int lSide = (sqrt(neighbors+1)-1)/2;
-        for (int i=0; i < width; i++) {
-            for (int j=0; j < height; j++) {
-                swSquareGridGenerator(i, j, width, height, lSide);
+//Network over the arrays of a trained network
+Network::Network(const NetworkArrays & net, uint64_t seed_value, int module) {
+
+    //Random seed initialization
+	seed(seed_value, module);
+
+    neurons = net.neurons;
+    neighbors = net.neighbors;
+    rewiring = net.rewiring;
+
+    off_p = net.row_off;
+    adj_p = net.adj;
+    w_p = net.w;
+    mapped = true;
+    topology_type = 0;
+    grid_width = 0;
+    tile_reach = 0;
+
+	initState();
+
+}
+
+void Network::initState() {
+	w_precision = 'd';
+	w_packed = false;
+	w_keep = false;
+	w_scale = 1.0;
+	V_o.assign(neurons, 0); //Network state in hebb learning phase
+	V_t.assign(neurons, 0); //Network state in time t
+	V_tp.assign(neurons, 0); //Network state in time t-1
+	TH.assign(neurons, 0); //Neurons' threshold
+
+	if (!pool)
+	    pool.reset(new ThreadPool(1)); //Serial update by default
+	delta = false;
+	cycle_window = 0;
+	profile = NULL;
+	trace = NULL;
+	trace_pattern = 0;
+	tile_set = 0;
+	lattice = 0;
+
+	max_row = 0;
+	for (int n = 0; n < neurons; n++)
+	    max_row = max(max_row, off_p[n+1] - off_p[n]);
+}
+
+void Network::syncViews() {
+    if (mapped)
+        return;
+    off_p = C_off.data();
+    adj_p = C.data();
+    w_p = W.data();
+}
+
+void Network::detach() {
+    if (mapped == false)
+        return;
+    C_off.assign(off_p, off_p + neurons + 1);
+    C.assign(adj_p, adj_p + C_off[neurons]);
+    W.assign(w_p, w_p + C_off[neurons]);
+    mapped = false;
+    syncViews();
+}
+
+NetworkArrays Network::arrays() {
+    restoreNumbering();
+    expandTopology();
+    unpackWeights();
+    NetworkArrays net;
+    net.neurons = neurons;
+    net.neighbors = neighbors;
+    net.rewiring = rewiring;
+    net.row_off = off_p;
+    net.adj = adj_p;
+    net.w = w_p;
+    return net;
+}
+
+void Network::latticeRow(int n, int * Cn) {
+    int kn = neighbors/2;
+    if (lattice == 'r' && n >= kn && n + kn < neurons) {
+        //Ring row without wrap around, as built by swRingGenerator
+        for (int j = 0; j < kn; j++) {
+            Cn[2*j] = n + (j + 1);
+            Cn[2*j+1] = n - (j + 1);
+        }
+        return;
+    }
+    switch (lattice) {
+        case 'r': swRingGenerator(n, Cn); break;
+        case 'c': swCrossGridGenerator(n, grid_width, Cn); break;
+        case 'x': swXGridGenerator(n, grid_width, Cn); break;
+    }
+}
+
+inline const int * Network::row(int n, int * buf) {
+    if (lattice == 0)
+        return adj_p + off_p[n];
+    latticeRow(n, buf);
+    for (int o = ov_off[n]; o < ov_off[n+1]; o++)
+        buf[ov_pos[o]] = ov_node[o];
+    return buf;
+}
+
+//Keeps the edges of C that differ from the lattice as the overlay and releases C
+void Network::setImplicitTopology(bool on) {
+    if (on == false) {
+        expandTopology();
+        return;
+    }
+    if (lattice != 0 || mapped || renumbered() || (topology_type != 'r' && topology_type != 'c' && topology_type != 'x')
+        || max_row > 65536)
+        return;
+
+    lattice = topology_type;
+    ov_off.assign(neurons+1, 0);
+    vector<int> buf(max_row);
+    for (int n = 0; n < neurons; n++) {
+        latticeRow(n, buf.data());
+        const int * Cn = &C[C_off[n]];
+        for (int k = 0; k < C_off[n+1] - C_off[n]; k++) {
+            if (Cn[k] != buf[k]) {
+                ov_pos.push_back(k);
+                ov_node.push_back(Cn[k]);
             }
         }
-	}
+        ov_off[n+1] = ov_node.size();
+    }
+    vector<int>().swap(C);
+    adj_p = NULL;
+}
 
+void Network::expandTopology() {
+    if (lattice == 0)
+        return;
+    C.resize(C_off[neurons]);
+    for (int n = 0; n < neurons; n++) {
+        latticeRow(n, &C[C_off[n]]);
+        for (int o = ov_off[n]; o < ov_off[n+1]; o++)
+            C[C_off[n] + ov_pos[o]] = ov_node[o];
+    }
+    lattice = 0;
+    vector<int>().swap(ov_off);
+    vector<uint16_t>().swap(ov_pos);
+    vector<int>().swap(ov_node);
+    syncViews();
 }
 
-//Builds small world SquareGrid topology matrix C
-void Network::swSquareGridGenerator(int i, int j, int width, int height, int lSide) {
+void Network::renumberNodes() {
+    detach();
+    expandTopology();
+    double before = neighborDistance();
+    vector<int> to = rcmOrder();
+    vector<int> from(neurons);
+    for (int n = 0; n < neurons; n++)
+        from[to[n]] = n;
+
+    //Distance of the order before moving anything
+    double dist = 0;
+    for (int j = 0; j < neurons; j++) {
+        int n = from[j];
+        for (int e = C_off[n]; e < C_off[n+1]; e++)
+            dist += abs(j - to[C[e]]);
+    }
+    if (C_off[neurons] == 0 || dist / C_off[neurons] >= before)
+        return;
+
+    permuteNodes(to);
+    if (old_id.empty()) {
+        old_id = from;
+        new_id = to;
+    }
+    else {
+        vector<int> ids(neurons);
+        for (int j = 0; j < neurons; j++)
+            ids[j] = old_id[from[j]];
+        old_id.swap(ids);
+        for (int j = 0; j < neurons; j++)
+            new_id[old_id[j]] = j;
+    }
+}
+
+void Network::restoreNumbering() {
+    if (renumbered() == false)
+        return;
+    vector<int> to(old_id);
+    permuteNodes(to);
+    vector<int>().swap(old_id);
+    vector<int>().swap(new_id);
+}
+
+void Network::permuteNodes(const vector<int> & to) {
+    detach();
+    expandTopology();
+    unpackWeights();
+
+    vector<int> from(neurons);
+    for (int n = 0; n < neurons; n++)
+        from[to[n]] = n;
+
+    //Rows move with their nodes, keeping the order of the neighbors and weights
+    vector<int> off(neurons+1, 0);
+    for (int j = 0; j < neurons; j++)
+        off[j+1] = off[j] + C_off[from[j]+1] - C_off[from[j]];
+    vector<int> adj(C.size());
+    vector<double> w(W.size());
+    for (int j = 0; j < neurons; j++) {
+        int n = from[j];
+        for (int e = C_off[n], f = off[j]; e < C_off[n+1]; e++, f++) {
+            adj[f] = to[C[e]];
+            if (w.empty() == false)
+                w[f] = W[e];
+        }
+    }
+    C_off.swap(off);
+    C.swap(adj);
+    W.swap(w);
+    syncViews();
+
+    //States, thresholds and queued probes, the delta structures are rebuilt
+    BitState * states[3] = {&V_o, &V_t, &V_tp};
+    for (int s = 0; s < 3; s++) {
+        perm_buf.assign(neurons, 0);
+        for (int j = 0; j < neurons; j++)
+            perm_buf.set(j, states[s]->get(from[j]));
+        states[s]->swap(perm_buf);
+    }
+    for (size_t q = 0; q < batch_V_o.size(); q++) {
+        perm_buf = batch_V_o[q];
+        for (int j = 0; j < neurons; j++)
+            batch_V_o[q].set(j, perm_buf.get(from[j]));
+        perm_buf = batch_V_t[q];
+        for (int j = 0; j < neurons; j++)
+            batch_V_t[q].set(j, perm_buf.get(from[j]));
+    }
+    vector<double> th(neurons);
+    for (int j = 0; j < neurons; j++)
+        th[j] = TH[from[j]];
+    TH.swap(th);
+    vector<int>().swap(rev_off);
+    vector<int>().swap(rev_node);
+    vector<int>().swap(rev_edge);
+}
+
+/*
+Cuthill-McKee over the symmetrized topology: every connected component is
+visited breadth-first from its lowest degree node, the new nodes of each
+node in increasing degree; the order is then reversed
+*/
+vector<int> Network::rcmOrder() {
+    vector<int> deg(neurons, 0);
+    for (int n = 0; n < neurons; n++) {
+        for (int e = off_p[n]; e < off_p[n+1]; e++) {
+            deg[n]++;
+            deg[adj_p[e]]++;
+        }
+    }
+    vector<int> s_off(neurons+1, 0);
+    for (int n = 0; n < neurons; n++)
+        s_off[n+1] = s_off[n] + deg[n];
+    vector<int> s_adj(s_off[neurons]);
+    vector<int> fill(s_off.begin(), s_off.end() - 1);
+    for (int n = 0; n < neurons; n++) {
+        for (int e = off_p[n]; e < off_p[n+1]; e++) {
+            s_adj[fill[n]++] = adj_p[e];
+            s_adj[fill[adj_p[e]]++] = n;
+        }
+    }
+
+    vector<int> starts(neurons);
+    for (int n = 0; n < neurons; n++)
+        starts[n] = n;
+    stable_sort(starts.begin(), starts.end(), [&](int a, int b) { return deg[a] < deg[b]; });
+
+    vector<int> order;
+    order.reserve(neurons);
+    vector<char> seen(neurons, 0);
+    for (int i = 0; i < neurons; i++) {
+        if (seen[starts[i]])
+            continue;
+        seen[starts[i]] = 1;
+        order.push_back(starts[i]);
+        for (size_t head = order.size() - 1; head < order.size(); head++) {
+            int n = order[head];
+            size_t first = order.size();
+            for (int e = s_off[n]; e < s_off[n+1]; e++) {
+                int m = s_adj[e];
+                if (seen[m] == 0) {
+                    seen[m] = 1;
+                    order.push_back(m);
+                }
+            }
+            stable_sort(order.begin() + first, order.end(), [&](int a, int b) { return deg[a] < deg[b]; });
+        }
+    }
+
+    vector<int> to(neurons);
+    for (int i = 0; i < neurons; i++)
+        to[order[i]] = neurons - 1 - i;
+    return to;
+}
+
+double Network::neighborDistance() const {
+    if (lattice != 0 || off_p[neurons] == 0)
+        return 0.0;
+    double dist = 0;
+    for (int n = 0; n < neurons; n++)
+        for (int e = off_p[n]; e < off_p[n+1]; e++)
+            dist += abs(n - adj_p[e]);
+    return dist / off_p[neurons];
+}
 
-     vector<int> tmpC;
-     vector<double> tmpW;
+/*
+Tile of rows image rows by tw columns: its halo is rows + 2*reach rows by
+tw + 2*reach columns, kept under half of L2 (the rest is for the adjacency
+and weights streamed by the sweep). Renumbered nodes are not an image.
+*/
+int Network::tileWidth(double node_bytes, int rows) const {
+    if (tile_reach == 0 || grid_width <= 0 || tile_set < 0 || renumbered())
+        return 0;
+    if (tile_set > 0)
+        return tile_set < grid_width ? tile_set : 0;
+
+    static long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE) > 0 ? sysconf(_SC_LEVEL2_CACHE_SIZE) : 256 * 1024;
+    double halo_rows = rows + 2 * tile_reach;
+    int tw = (int)(l2 / 2 / (halo_rows * node_bytes)) - 2 * tile_reach;
+    if (tw >= grid_width)
+        return 0; //The halo of whole rows fits
+    return max(tw, 16);
+}
+
+template <class F>
+void Network::tiledRuns(int n0, int n1, int tw, F f) const {
+    if (tw <= 0) {
+        f(n0, n1);
+        return;
+    }
+    int y0 = n0 / grid_width;
+    int y1 = (n1 - 1) / grid_width;
+    for (int x0 = 0; x0 < grid_width; x0 += tw) {
+        int x1 = min(grid_width, x0 + tw);
+        for (int y = y0; y <= y1; y++) {
+            int a = max(n0, y * grid_width + x0);
+            int b = min(n1, y * grid_width + x1);
+            if (a < b)
+                f(a, b);
+        }
+    }
+}
+
+const uint64_t * Network::networkOrder(const uint64_t * pattern, BitState & buf) {
+    if (renumbered() == false)
+        return pattern;
+    buf.assign(neurons, 0);
+    for (int j = 0; j < neurons; j++)
+        buf.set(j, bitAt(pattern, old_id[j]));
+    return buf.data();
+}
+
+MemoryUse Network::memoryUse() const {
+    MemoryUse use;
+    use.adjacency = topologyBytes() + (rev_off.capacity() + rev_node.capacity() + rev_edge.capacity()) * sizeof(int);
+
+    use.weights = W.capacity() * sizeof(double) + W_f.capacity() * sizeof(float) + W_i.capacity() * sizeof(int16_t);
+    if (mapped)
+        use.weights += (size_t)off_p[neurons] * sizeof(double);
+
+    size_t state_bytes = V_t.nwords() * sizeof(uint64_t); //Packed state of the network
+    use.states = 3 * state_bytes + TH.capacity() * sizeof(double)
+        + (batch_V_o.capacity() + batch_V_t.capacity()) * state_bytes
+        + (d_count.capacity() + d_dirty.capacity() + d_flips.capacity() + step_flips.capacity()) * sizeof(int)
+        + (d_sum.capacity() + d_wsum.capacity() + d_abs.capacity()) * sizeof(double) + d_mark.capacity()
+        + trace_prev.nwords() * sizeof(uint64_t) + trace_rec.capacity()
+        + (old_id.capacity() + new_id.capacity()) * sizeof(int);
+    return use;
+}
+
+size_t Network::topologyBytes() const {
+    size_t bytes = (neurons + 1) * sizeof(int);
+    if (lattice != 0)
+        return bytes + ov_off.size() * sizeof(int) + ov_pos.size() * (sizeof(uint16_t) + sizeof(int));
+    return bytes + (size_t)off_p[neurons] * sizeof(int);
+}
+
+//Sets the weight precision of the updates
+void Network::setWeightPrecision(char precision, bool keep_double) {
+    if (precision != 'f' && precision != 'i')
+        precision = 'd';
+    if (precision != w_precision || keep_double != w_keep) {
+        unpackWeights();
+        w_precision = precision;
+        w_keep = keep_double;
+    }
+}
+
+int Network::weightBytes() const {
+    switch (w_precision) {
+        case 'f': return sizeof(float);
+        case 'i': return sizeof(int16_t);
+    }
+    return sizeof(double);
+}
+
+//Converts the learned weights W to the weight precision
+void Network::packWeights() {
+    if (w_packed || w_precision == 'd')
+        return;
+
+    size_t edges = off_p[neurons];
+    if (w_precision == 'f') {
+        W_f.assign(w_p, w_p + edges);
+    }
+    else {
+        //Fixed point scale: the largest weight maps to the largest int16
+        double w_max = 0.0;
+        for (size_t e = 0; e < edges; e++)
+            w_max = max(w_max, fabs(w_p[e]));
+        w_scale = w_max > 0.0 ? w_max / 32767 : 1.0;
+        W_i.resize(edges);
+        for (size_t e = 0; e < edges; e++)
+            W_i[e] = (int16_t)lround(w_p[e] / w_scale);
+    }
+
+    //Mapped weights are not owned and stay in place
+    if (w_keep == false && mapped == false) {
+        vector<double>().swap(W);
+        syncViews();
+    }
+    w_packed = true;
+}
+
+//Restores the learned weights W from the reduced weights
+void Network::unpackWeights() {
+    if (w_packed == false)
+        return;
+
+    //Restores W if packWeights released it
+    if (mapped == false && W.size() != (size_t)C_off[neurons]) {
+        W.resize(C_off[neurons]);
+        for (size_t e = 0; e < W.size(); e++)
+            W[e] = w_precision == 'f' ? (double)W_f[e] : W_i[e] * w_scale;
+        syncViews();
+    }
+    vector<float>().swap(W_f);
+    vector<int16_t>().swap(W_i);
+    w_packed = false;
+}
+
+//Sets the number of threads of the update sweep (0: all hardware threads)
+void Network::setThreads(int nthreads) {
+    if (nthreads < 1)
+        nthreads = ThreadPool::hardwareThreads();
+    if (nthreads != pool->size())
+        pool.reset(new ThreadPool(nthreads));
+}
+
+int Network::threads() const {
+    return pool->size();
+}
+
+//Builds small world SquareGrid topology matrix C
+int Network::swSquareGridGenerator(int i, int j, int width, int height, int lSide, int * Ci) {
 
      int ni = i * width + j;
 
@@ -225,34 +1149,28 @@ void Network::swSquareGridGenerator(int i, int j, int width, int height, int lSi
           fJ = width-1; iJ = fJ - 2*lSide;
      }
 
-     //Builiding connectivity matrix C
+     //Builiding connectivity matrix C, the first K nodes of the window
+     //(a window without the node itself holds one node more, never read)
      int kC = 0; //K counter
-     for (int ip=iI; ip <= fI; ip++) {
-          for (int jp=iJ; jp <= fJ; jp++) {
+     for (int ip=iI; ip <= fI && kC < neighbors; ip++) {
+          for (int jp=iJ; jp <= fJ && kC < neighbors; jp++) {
                int kip = ip * width + jp;
                 if (kip != ni) {
-                     tmpC.push_back(kip);
-                     tmpW.push_back(0.0);
+                     if (Ci != NULL)
+                          Ci[kC] = kip;
                      kC++;
                }
           }
      }
 
-	C.push_back(tmpC);
-	W.push_back(tmpW);
-
-	//Rewiring connectivity
-	if (rewiring > 0.0) {
-	    swRewiring(ni);
-	}
+     return kC;
 
 }
 
 //Builds erdos-renyi topology matrix C
-void Network::erSymGenerator(int i) {
-    vector<int> tmpC;
-    vector<double> tmpW;
-    int kn = neighbors;
+void Network::erSymGenerator(int i, int * Ci) {
+    //Only the first K right/left neighbors are stored (and ever used)
+    int kn = (neighbors + 1)/2;
 
     //Builiding connectivity matrix C
     for (int j = 0; j < kn; j++)
@@ -260,34 +1178,29 @@ void Network::erSymGenerator(int i) {
         //Generating Right neighbors
         int rn = i + (j + 1);
         if (rn < neurons) {
-            tmpC.push_back(rn);
+            Ci[2*j] = rn;
         }
         else {
-            tmpC.push_back(rn - neurons);
+            Ci[2*j] = rn - neurons;
         }
-        tmpW.push_back(0.0);
 
-        //Generating Left neighbors
+        //Generating Left neighbors, dropped when K is odd
+        if (2*j+1 == neighbors)
+            break;
         int ln = i - (j+1);
         if (ln < 0) {
-            tmpC.push_back(neurons + ln);
+            Ci[2*j+1] = neurons + ln;
         }
         else {
-            tmpC.push_back(ln);
+            Ci[2*j+1] = ln;
         }
-        tmpW.push_back(0.0);
 
     }
 
-    C.push_back(tmpC);
-    W.push_back(tmpW);
-
 }
 
 //Builds small world RING topology matrix C
-void Network::swRingGenerator(int i) {
-    vector<int> tmpC;
-    vector<double> tmpW;
+void Network::swRingGenerator(int i, int * Ci) {
 	int kn = neighbors/2;
 
     //Builiding connectivity matrix C
@@ -296,39 +1209,27 @@ void Network::swRingGenerator(int i) {
 		//Generating Right neighbors
 		int rn = i + (j + 1);
 		if (rn < neurons) {
-			tmpC.push_back(rn);
+			Ci[2*j] = rn;
 		}
 		else {
-			tmpC.push_back(rn - neurons);
+			Ci[2*j] = rn - neurons;
 		}
-		tmpW.push_back(0.0);
 
 		//Generating Left neighbors
 		int ln = i - (j+1);
 		if (ln < 0) {
-			tmpC.push_back(neurons + ln);
+			Ci[2*j+1] = neurons + ln;
 		}
 		else {
-			tmpC.push_back(ln);
+			Ci[2*j+1] = ln;
 		}
-		tmpW.push_back(0.0);
-
-	}
-
-	C.push_back(tmpC);
-	W.push_back(tmpW);
 
-	//Rewiring connectivity
-	if (rewiring > 0.0) {
-	    swRewiring(i);
 	}
 
 }
 
 //Builds small world XGRID topology matrix C
-void Network::swXGridGenerator(int i, int width) {
-    vector<int> tmpC;
-    vector<double> tmpW;
+void Network::swXGridGenerator(int i, int width, int * Ci) {
 	int kn = neighbors/4;
 
 	//Builiding connectivity matrix C
@@ -337,59 +1238,45 @@ void Network::swXGridGenerator(int i, int width) {
 		//Generating Right-Down Neighbors
 		int RDN = i + (width + 1)*(j+1);
 		if (RDN < neurons) {
-			tmpC.push_back(RDN);
+			Ci[4*j] = RDN;
 		}
 		else {
-			tmpC.push_back(RDN - neurons);
+			Ci[4*j] = RDN - neurons;
 		}
-		tmpW.push_back(0.0);
 
 		//Generating Left-Down Neighbors
 		int LDN = i + (width - 1)*(j+1);
 		if (LDN < neurons) {
-			tmpC.push_back(LDN);
+			Ci[4*j+1] = LDN;
 		}
 		else {
-		    tmpC.push_back(LDN - neurons);
+		    Ci[4*j+1] = LDN - neurons;
         }
-		tmpW.push_back(0.0);
 
 		//Generating Right-Up Neighbors
 		int RUN = i - (width - 1)*(j+1);
 		if (RUN < 0) {
-			tmpC.push_back(RUN + neurons);
+			Ci[4*j+2] = RUN + neurons;
 		}
 		else {
-			tmpC.push_back(RUN);
+			Ci[4*j+2] = RUN;
 		}
-		tmpW.push_back(0.0);
 
 		//Generating Left-Up Neighbors
 		int LUN = i - (width + 1)*(j+1);
 		if (LUN < 0) {
-			tmpC.push_back(LUN + neurons);
+			Ci[4*j+3] = LUN + neurons;
 		}
 		else {
-		    tmpC.push_back(LUN);
+		    Ci[4*j+3] = LUN;
         }
-		tmpW.push_back(0.0);
 
 	}
 
-    C.push_back(tmpC);
-	W.push_back(tmpW);
-
-	//Rewiring connectivity
-	if (rewiring > 0.0) {
-	    swRewiring(i);
-	}
-
 }
 
 //Builds small world CROSS GRID neighborhood
-void Network::swCrossGridGenerator(int i, int width) {
-    vector<int> tmpC;
-    vector<double> tmpW;
+void Network::swCrossGridGenerator(int i, int width, int * Ci) {
 	int kn = neighbors/4;
 
 	//Builiding connectivity matrix C
@@ -398,75 +1285,77 @@ void Network::swCrossGridGenerator(int i, int width) {
 		//Generating Right neighbors
 		int rn = i + (j + 1);
 		if (rn < neurons) {
-			tmpC.push_back(rn);
+			Ci[2*j] = rn;
 		}
 		else {
-			tmpC.push_back(rn - neurons);
+			Ci[2*j] = rn - neurons;
 		}
-		tmpW.push_back(0.0);
 
 		//Generating Left neighbors
 		int ln = i - (j+1);
 		if (ln < 0) {
-			tmpC.push_back(neurons + ln);
+			Ci[2*j+1] = neurons + ln;
 		}
 		else {
-			tmpC.push_back(ln);
+			Ci[2*j+1] = ln;
 		}
-		tmpW.push_back(0.0);
 	}
 
+	Ci += 2*kn;
 	for (int j = 0; j < kn; j++)
 	{
 		//Generating down neighbors
 		int dn = i + (j+1)*width;
 		if (dn < neurons) {
-			tmpC.push_back(dn);
+			Ci[2*j] = dn;
 		}
 		else {
-			tmpC.push_back(dn - neurons);
+			Ci[2*j] = dn - neurons;
 		}
-		tmpW.push_back(0.0);
 
 		//Generating upper neighbors
 		int un = i - (j+1)*width;
 		if (un < 0) {
-			tmpC.push_back(neurons + un);
+			Ci[2*j+1] = neurons + un;
 		}
 		else {
-			tmpC.push_back(un);
+			Ci[2*j+1] = un;
 		}
-		tmpW.push_back(0.0);
-
-	}
-
-	C.push_back(tmpC);
-	W.push_back(tmpW);
 
-    //Rewiring connectivity
-	if (rewiring > 0.0) {
-	    swRewiring(i);
 	}
 
 }
 
 //Rewires the connectivity adjacency list of the input node with the network rewiring probability
-void Network::swRewiring(int i) {
+void Network::swRewiring(int i, NodeSet & set) {
+
+    int * Ci = &C[C_off[i]]; //Adjacency row of node i
+    int kn = C_off[i+1] - C_off[i];
+    RandomStream rng(rng_seed, rng_module, i, RNG_REWIRING);
+
+    for (int j = 0; j < kn; j++)
+        set.insert(Ci[j]);
 
-    for (int j = 0; j < neighbors; j++) {
-		double rg = unifRand(); //generates random value between 0 and 1
+    for (int j = 0; j < kn; j++) {
+		double rg = rng.unif(); //generates random value between 0 and 1
 		bool found = true;
 		if (rg  < rewiring) {
 			do {
-                int newNode = (int)floor(unifRand()*neurons); //Generates a new random node
-                found = searchValue(newNode, i); //Test if new node is already a neighbor
+                int newNode = rng.below(neurons); //Generates a new random node
+                found = set.contains(newNode); //Test if new node is already a neighbor
                 //Test for repeated nodes, self-connection, and if node is out of neuron's range
-                if (found == false && newNode != i && newNode >= 0 && newNode < neurons)
-                    C[i][j] = newNode; //Assings new random node to neighborhood
+                if (found == false && newNode != i && newNode >= 0 && newNode < neurons) {
+                    set.erase(Ci[j]);
+                    set.insert(newNode);
+                    Ci[j] = newNode; //Assings new random node to neighborhood
+                }
 			} while (found == true);
 		}
 	}
 
+	for (int j = 0; j < kn; j++)
+	    set.erase(Ci[j]);
+
 }
 
 //Reads pattern from file
@@ -480,12 +1369,18 @@ void Network::loadPatternFile(char * file) {
 
   		fscanf(pFile, "%s", str);
 
-        V_o[ni] = (short int)atoi(str);
+        V_o.set(renumbered() ? new_id[ni] : ni, atoi(str) != 0);
 
   	}
   	fclose(pFile);
 }
 
+//Copies a packed pattern, i.e. a bitmap of a packed pattern file
+void Network::loadPattern(const uint64_t * words) {
+    words = networkOrder(words, perm_buf);
+    memcpy(V_o.data(), words, V_o.nwords() * sizeof(uint64_t));
+}
+
 void Network::randomPattern(double sparseness, const char * file_out) {
     FILE * oFile = fopen (file_out,"w");
 
@@ -508,12 +1403,7 @@ void Network::randomPattern(double sparseness) {
 
 	for (int i = 0; i < neurons; i++) {
 	    double rg = unifRand(); //generates random value between 0 and 1
-	    if (rg < sparseness)  {
-            V_o[i] = 1;
-        }
-        else {
-            V_o[i] = 0;
-        }
+	    V_o.set(renumbered() ? new_id[i] : i, rg < sparseness);
 	}
 }
 
@@ -550,47 +1440,237 @@ vector<int> Network::randPatternSet(int setS, int totalPat) {
 
 //Sets network initial condition
 void Network::networkInitialCodition() {
-    for (int i = 0; i < neurons; i++) {
-        V_t[i] = V_o[i];
-    }
+    V_t = V_o;
 }
 
-//Sets network noisy initial condition with the input noise
+/*
+Sets network noisy initial condition with the input noise.
+Node i reads values 2i and 2i+1 of the noise stream of the probe, so the
+chunks of nodes are set in parallel with the same result for any thread count
+(i is the original number of a renumbered node)
+*/
 void Network::networkInitialCodition(double noise) {
+    RandomStream rng(rng_seed, rng_module, noise_probe++, RNG_NOISE);
+    if (noise <= 0.0) {
+        V_t = V_o;
+        return;
+    }
+
     double V_o_act = vectorMean(V_o);
-    double rg = 0, rg1 = 0;
-    for (int i = 0; i < neurons; i++) {
-        rg = unifRand();
-        if (rg < noise) {
-            rg1 = unifRand();
-            if (rg1 < V_o_act) {
-                V_t[i] = 1;
+    int nchunks = (neurons + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+    pool->parallelFor(nchunks, [&](int c) {
+        int n0 = c * SWEEP_CHUNK;
+        int n1 = min(neurons, n0 + SWEEP_CHUNK);
+        for (int i = n0; i < n1; i++) {
+            uint64_t key = renumbered() ? old_id[i] : i;
+            double rg = rng.unifAt(2*key);
+            if (rg < noise) {
+                double rg1 = rng.unifAt(2*key + 1);
+                if (rg1 < V_o_act) {
+                    V_t.set(i, 1);
+                }
+                else {
+                    V_t.set(i, 0);
+                }
             }
-            else {
-                V_t[i] = 0;
+            else
+            {
+                V_t.set(i, V_o[i]);
             }
         }
-        else
-        {
-            V_t[i] = V_o[i];
-        }
-    }
+    });
+}
+
+//Sets network noisy initial condition from a packed pattern
+void Network::networkInitialCodition(double noise, const uint64_t * pattern) {
+    loadPattern(pattern); //Kept in V_o as the reference of the overlaps
+    networkInitialCodition(noise);
 }
 
 //Performs hebb learning
 void Network::hebbLearning() {
-    double V_o_act = vectorMean(V_o); //Gets pattern global activtiy
+    hebbLearning(V_o.data());
+}
+
+//Performs hebb learning of a packed pattern
+void Network::hebbLearning(const uint64_t * vo) {
+    if (vo != V_o.data()) //V_o is already in the network numbering
+        vo = networkOrder(vo, perm_buf);
+    detach();
+    unpackWeights(); //Learning accumulates in double
+    double V_o_act = patternMean(vo); //Gets pattern global activtiy
     double W_std_factor = V_o_act * (1 - V_o_act); //Gets activity variance
 	float tmphebb;
-	for (int n = 0; n < neurons; n++)
+	vector<int> buf(max_row); //Row of an implicit lattice
+	//Every weight is its own edge, so the tiled order of the grids learns the same weights
+	tiledRuns(0, neurons, tileWidth(0.125, neurons / max(grid_width, 1)), [&](int n0, int n1) {
+	for (int n = n0; n < n1; n++)
 	{
 	    tmphebb = 0.0;
-		for (int k = 0; k < neighbors; k++) {
+	    const int * Cn = row(n, buf.data()); //Adjacency row of node n
+	    double * Wn = &W[0] + C_off[n]; //Weights of node n
+	    int kn = C_off[n+1] - C_off[n];
+		for (int k = 0; k < kn; k++) {
 		    //Performs hebb learning of pattern stored in V_o
-			tmphebb = (V_o[n] - V_o_act) * (V_o[C[n][k]] - V_o_act) / ( W_std_factor );
-			W[n][k] += tmphebb; //Update weight matrix
+			tmphebb = (bitAt(vo, n) - V_o_act) * (bitAt(vo, Cn[k]) - V_o_act) / ( W_std_factor );
+			Wn[k] += tmphebb; //Update weight matrix
 		}
 	}
+	});
+}
+
+/*
+Batched hebb learning. The patterns are transposed to a P-bit row per neuron
+(bit p of row n is node n in pattern p), so for the edge n->m the patterns
+where both nodes are active are the bits of row_n & row_m, and those where
+only m is active the bits of ~row_n & row_m. The weight of the edge is
+    W += sum_p v_p(xi_n, 0) + sum_{row_n & row_m} d_p(1) + sum_{~row_n & row_m} d_p(0)
+with v_p(x, y) the float increment of hebbLearning for pattern p and
+d_p(x) = v_p(x, 1) - v_p(x, 0). The sums over the bits of a mask are read
+from tables of the partial sums of every byte of the rows.
+All the increments are multiples of the smallest ulp among them; while the
+weights stay below 2^53 of those ulps every partial sum is exact, so any order
+of the additions gives the weights of the sequential learning. Otherwise
+(i.e. patterns with no active nodes) the patterns are learned one by one.
+*/
+void Network::hebbLearningBatch(const vector<const uint64_t *> & patterns) {
+    int np = patterns.size();
+    if (np == 0)
+        return;
+
+    detach();
+    unpackWeights(); //Learning accumulates in double
+
+    //Patterns in the network numbering
+    vector<BitState> renumbered_patterns(renumbered() ? np : 0);
+    vector<const uint64_t *> net_patterns(patterns);
+    for (int p = 0; p < (int)renumbered_patterns.size(); p++)
+        net_patterns[p] = networkOrder(patterns[p], renumbered_patterns[p]);
+
+    //Increments of every pattern, v[p][x][y] as computed by hebbLearning
+    vector< vector< vector<double> > > v(np, vector< vector<double> >(2, vector<double>(2)));
+    int e_min = 1 << 30; //Exponent of the smallest ulp of the increments
+    double bound = 0.0; //Bound of the sums of the batch
+    bool exact = true;
+    for (int p = 0; p < np; p++) {
+        double V_o_act = patternMean(patterns[p]);
+        double W_std_factor = V_o_act * (1 - V_o_act);
+        double v_max = 0.0;
+        for (int x = 0; x < 2; x++) {
+            for (int y = 0; y < 2; y++) {
+                float tmphebb = (x - V_o_act) * (y - V_o_act) / ( W_std_factor );
+                v[p][x][y] = tmphebb;
+                if (isfinite(tmphebb) == false) {
+                    exact = false;
+                }
+                else if (tmphebb != 0) {
+                    int e;
+                    frexp(tmphebb, &e);
+                    e_min = min(e_min, e - 24); //float significand of 24 bits
+                    v_max = max(v_max, fabs((double)tmphebb));
+                }
+            }
+        }
+        bound += 3 * v_max;
+    }
+
+    //Current weights must be multiples of the ulp and keep the bound
+    double w_max = 0.0;
+    for (size_t e = 0; exact && e < W.size(); e++) {
+        double q = ldexp(W[e], -e_min);
+        if (q != rint(q))
+            exact = false;
+        w_max = max(w_max, fabs(W[e]));
+    }
+    if (exact == false || w_max + bound >= ldexp(1.0, e_min + 53)) {
+        for (int p = 0; p < np; p++)
+            hebbLearning(patterns[p]);
+        return;
+    }
+
+    //Transposed patterns: pw words per neuron, bit p%64 of word p/64 is pattern p
+    int pw = (np + 63) / 64;
+    int nwords = (neurons + 63) / 64;
+    vector<uint64_t> rows((size_t)neurons * pw, 0);
+    uint64_t a[64];
+    for (int w = 0; w < nwords; w++) {
+        for (int b = 0; b < pw; b++) {
+            for (int i = 0; i < 64; i++)
+                a[i] = b*64 + i < np ? net_patterns[b*64 + i][w] : 0;
+            transpose64(a);
+            for (int j = 0; j < 64 && w*64 + j < neurons; j++)
+                rows[(size_t)(w*64 + j) * pw + b] = a[j];
+        }
+    }
+
+    //Byte tables: tab[j*256 + x] is the sum of the values of the patterns 8j+i with bit i set in x,
+    //patterns past np add 0 so the unused bits of the rows need no mask
+    int nbytes = pw * 8;
+    vector<double> base1(nbytes * 256), base0(nbytes * 256), d1(nbytes * 256), d0(nbytes * 256);
+    vector<double> * tabs[4] = {&base1, &base0, &d1, &d0};
+    for (int t = 0; t < 4; t++) {
+        vector<double> & tab = *tabs[t];
+        for (int j = 0; j < nbytes; j++) {
+            tab[j*256] = 0.0;
+            for (int x = 1; x < 256; x++) {
+                int p = j*8 + __builtin_ctz(x);
+                double val = 0.0;
+                if (p < np) {
+                    switch (t) {
+                        case 0: val = v[p][1][0]; break;
+                        case 1: val = v[p][0][0]; break;
+                        case 2: val = v[p][1][1] - v[p][1][0]; break;
+                        case 3: val = v[p][0][1] - v[p][0][0]; break;
+                    }
+                }
+                tab[j*256 + x] = tab[j*256 + (x & (x - 1))] + val;
+            }
+        }
+    }
+
+    int nchunks = (neurons + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+    int tw = tileWidth(8.0 * pw, SWEEP_CHUNK / max(grid_width, 1) + 1); //Tiles of the transposed rows
+    pool->parallelFor(nchunks, [&](int c) {
+        vector<int> buf(lattice ? max_row : 0); //Row of an implicit lattice
+        tiledRuns(c * SWEEP_CHUNK, min(neurons, (c + 1) * SWEEP_CHUNK), tw, [&](int n0, int n1) {
+        for (int n = n0; n < n1; n++) {
+            const uint64_t * Rn = &rows[(size_t)n * pw];
+
+            //Sum of v_p(xi_n, 0) over the patterns
+            double base = 0.0;
+            for (int b = 0; b < pw; b++) {
+                for (int j = 0; j < 8; j++) {
+                    int jb = (b*8 + j) * 256;
+                    base += base1[jb + ((Rn[b] >> (8*j)) & 255)];
+                    base += base0[jb + ((~Rn[b] >> (8*j)) & 255)];
+                }
+            }
+
+            const int * Cn = row(n, buf.data());
+            double * Wn = &W[0] + C_off[n];
+            int kn = C_off[n+1] - C_off[n];
+            for (int k = 0; k < kn; k++) {
+                const uint64_t * Rm = &rows[(size_t)Cn[k] * pw];
+                double sum = base;
+                for (int b = 0; b < pw; b++) {
+                    uint64_t x1 = Rn[b] & Rm[b]; //Both nodes active
+                    uint64_t x0 = ~Rn[b] & Rm[b]; //Only the neighbor active
+                    while (x1 != 0) {
+                        int j = __builtin_ctzll(x1) >> 3;
+                        sum += d1[(b*8 + j) * 256 + ((x1 >> (8*j)) & 255)];
+                        x1 &= ~((uint64_t)255 << (8*j));
+                    }
+                    while (x0 != 0) {
+                        int j = __builtin_ctzll(x0) >> 3;
+                        sum += d0[(b*8 + j) * 256 + ((x0 >> (8*j)) & 255)];
+                        x0 &= ~((uint64_t)255 << (8*j));
+                    }
+                }
+                Wn[k] += sum; //Update weight matrix
+            }
+        }
+        });
+    });
 }
 
 //Network update for every time step
@@ -605,31 +1685,32 @@ vector<double> Network::updateNet(int s_time, int blocks, double sparseness, cha
 	net_var.push_back(0); //value of q_d (block activity)
 	net_var.push_back(0); //value of th_m (mean threshold value)
 	net_var.push_back(0); //value of th_d (threshold std dev)
+	vector<double> net_var_t(net_var); //Values of the time step
 
     /*Stores state of the network in t-1 step for parallel updating
     All neurons update their activity states simultaneously at discrete time steps
-    The previous state in t-1 need to be stored to calculate the actual t state
+    The previous state in t-1 need to be stored to calculate the actual t state,
+    V_tp holds it and the sweep writes the new state over the one of t-2
     */
-	vector<bool> V_tp;
-    V_tp.reserve(neurons);
+	blockSegments(blocks, md_sums);
 
-    //File variables values to store variables values at every time step to a text file
-    char file_time[256];
-    char file_win[256];
+    //Files to store variables values at every time step, open until the end of the update
+    BufferedFile tFile;
+    BufferedFile winFile;
 
     //w_file = true: network update results are printed for every time step
     if ( w_filename == true) {
         //File name to store m (gobal overlap), d (block overlap) evolution in time
+        char file_time[256];
         strcpy(file_time, "mdqintime_");
         strcat(file_time, file_name);
-        FILE * tFile = fopen (file_time,"w");
-        fclose(tFile);
+        tFile.open(file_time, "w");
 
         //File name to store overlaps for the specified windows size for every time step
+        char file_win[256];
         strcpy(file_win, "xmi_");
         strcat(file_win, file_name);
-        FILE * winFile = fopen (file_win,"w");
-        fclose(winFile);
+        winFile.open(file_win, "w");
 
     }
 
@@ -645,26 +1726,49 @@ vector<double> Network::updateNet(int s_time, int blocks, double sparseness, cha
     //calculating slope for linear threshold function
     double slope = ((-2)*th_value) / (1 - 2 * sparseness);
 
+    //Per chunk changed and active node counts of the parallel sweep
+    int nchunks = (neurons + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+    int tile_width = tileWidth(0.125, SWEEP_CHUNK / max(grid_width, 1) + 1); //Tiles of the packed state
+    vector<int> chunk_hamm(nchunks);
+    vector<int> chunk_active(nchunks);
+
+    //Active nodes of the current network state
+    int active = V_t.count();
+
+    //Step parameters of the previous step, for the delta update
+    StepParams sp_prev = StepParams();
+
+    //Cycle detection over the states the statistics are computed from
+    StateHistory history(max(cycle_window, 1), V_t.nwords());
+    int period = 0;
+
+    packWeights();
+    if (delta && rev_off.empty())
+        buildReverse();
+    step_flips.clear();
+
     //Loop updates network for every time step
 	for (int t = 0; t < s_time; t++) {
 		//printf("Updating.................%d\r", t);
 
         //Network global activity
-		double global_activity = 0.0;
+		double global_activity = active;
 
         /*
         Storing previous state of the network
-        and calculating global activiy of the network for every time step
+        and calculating global activiy of the network for every time step.
+        The sweep writes every node, so the states are swapped instead of copied;
+        the delta update writes only the changed nodes of a copy
 		*/
-		for (int n = 0; n < neurons; n++) {
-		    global_activity += V_t[n];
-            V_tp[n] = V_t[n];
-		}
+		if (delta)
+		    V_tp = V_t;
+		else
+		    V_tp.swap(V_t);
 
 		global_activity /= neurons;
 
-        //Calculates the percentage of bits changing every time step
-		int hamm_dist = 0;
+        //Packed previous state for the neighbors gathering
+        const uint64_t * vp = V_tp.data();
 
 		/*
 		Calculates overlap between initial network state and pattern
@@ -679,98 +1783,77 @@ vector<double> Network::updateNet(int s_time, int blocks, double sparseness, cha
         else
             rho1 = rho;
 
-        //Updating network node states
-		for (int n = 0; n < neurons; n++) {
-
-			double neural_field = 0.0; //Neural field calculated for each node n
-			double local_activity = 0.0; //Local activity of node n neighborhood
-			double varA; //Variance of local_activity
+        /*
+        Updating network node states
+        Each chunk writes only its own words of V_t, and counts its changed
+        and active nodes for the hamming distance and the next global activity,
+        and the block sums of the statistics of its nodes while TH is in cache
+        */
+        StepParams sp;
+        sp.th_fun = th_fun;
+        sp.sparseness = sparseness;
+        sp.th_value = th_value;
+        sp.slope = slope;
+        sp.global_activity = global_activity;
+        sp.rho1 = rho1;
+
+        buildStepTable(sp, step_tab);
+
+        int hamm_dist = 0;
+        if (delta) {
+            //Every node at the first step and when the threshold of unchanged nodes may change
+            bool all = t == 0 || (sp.th_fun == 'r' && (sp.global_activity != sp_prev.global_activity
+                || sp.rho1 != sp_prev.rho1)) || (sp.th_fun == 't' && sp.rho1 != sp_prev.rho1);
+            if (t == 0)
+                deltaInitState(vp);
+            hamm_dist = deltaStep(vp, step_tab, all, t + 1, active);
+            sp_prev = sp;
+            blockSums(blocks, V_o, V_tp, true, md_sums);
+        }
+        else {
+            pool->parallelFor(nchunks, [&](int c) {
+                int n0 = c * SWEEP_CHUNK;
+                int n1 = min(neurons, n0 + SWEEP_CHUNK);
+                updateRange(n0, n1, vp, step_tab, tile_width);
+                chunk_hamm[c] = V_t.hammingWords(V_tp, n0 / 64, (n1 + 63) / 64);
+                chunk_active[c] = V_t.countWords(n0 / 64, (n1 + 63) / 64);
+                if (renumbered() == false)
+                    chunkSums(md_sums, c, V_o, V_tp, true);
+            });
+            if (renumbered())
+                blockSums(blocks, V_o, V_tp, true, md_sums); //Sums in the original node order
+            else
+                reduceSums(md_sums);
 
-            //Calculating local activity of the k-neighbors of node n
-            for (int k = 0; k < neighbors; k++) {
-                local_activity += V_tp[C[n][k]];
+            //Calculates the percentage of bits changing every time step
+            active = 0;
+            for (int c = 0; c < nchunks; c++) {
+                hamm_dist += chunk_hamm[c];
+                active += chunk_active[c];
             }
+        }
 
-            local_activity /= neighbors;
-
-            //Avoids division by zero when patterns are very sparse
-            if (local_activity != 0.0) {
-
-                varA = local_activity*(1.0-local_activity); //Variance of local_activity
-
-                varA=sqrt(varA); //Std dev of local_activity
-
-                //Calculating neural field of node n
-                for (int k = 0; k < neighbors; k++) {
-
-                    neural_field += W[n][k] * (V_tp[C[n][k]] - local_activity);
-
-                }
-
-                neural_field /= varA;
-
-                neural_field /= neighbors;
-
-                /*
-                Calculates dynamic threshold TH[n] for every node at every time step
-                */
-                switch(th_fun) {
-                    //linear threshold function
-                    case 'l':
-                    {
-                        TH[n] = cutlinearFunction(sparseness, th_value, local_activity, slope);
-                    }
-                    break;
-                    //rho threshold function
-                    case 'r':
-                    {
-                        TH[n] = rhoFunction(sparseness, global_activity, local_activity, th_value, rho1);
-                    }
-                    break;
-                    //step threshold function
-                    case 's':
-                    {
-                        TH[n] = stepFunction(local_activity, th_value);
-                    }
-                    break;
-                    //sine threshold function
-                    case 't':
-                    {
-                        double th_v1 = th_value/rho1;
-                        TH[n] = sinFunction(local_activity, th_v1);
-                    }
-                    break;
-                    //Step-cut threshold function
-                    case 'c':
-                    {
-                        TH[n] = stepCutFunction(local_activity, sparseness, th_value);
-                    }
-                    break;
-                }
-
-                neural_field -= TH[n];
-
-                //Updating each node state V_t[n] at time t
-                if (neural_field >= 0) {
-                    V_t[n] = 1;
-                }
-                else {
-                    V_t[n] = 0;
-                }
-
-			}
-
-            //Calculating if state changed for hamming distance count
-			if (V_t[n] != V_tp[n])
-                hamm_dist++;
-
-		}
+        if (profile != NULL)
+            step_flips.push_back(hamm_dist);
 
         //Calculating overlap between net state and pattern for time t
-	    vector<double> net_var_t = mdCalculate(blocks, sparseness, V_o, V_tp);
+	    mdFromSums(md_sums, net_var_t.data());
 
         //Comparing t network state with state at t-1 to test stop criterion
-	    bool md_eq = mdComparison(net_var, net_var_t);
+	    bool md_eq = t > 0 && mdStop(blocks, V_o, md_prev, V_tp, net_var, net_var_t);
+	    md_prev = V_tp;
+
+	    if (trace != NULL && trace_pattern > 0)
+	        traceStep(t);
+
+	    //A repeated state is a fixed point or cycle once the steps since it use the same parameters
+	    if (cycle_window > 0) {
+	        period = history.push(V_tp.data());
+	        if (period > 0 && (t - period >= 20 || (th_fun != 'r' && th_fun != 't')))
+	            md_eq = true;
+	        else
+	            period = 0; //Only a repetition that stops the update is reported
+	    }
 
         //Calculating and printing results for every time step
 	    if ( w_filename == true ) {
@@ -783,26 +1866,27 @@ vector<double> Network::updateNet(int s_time, int blocks, double sparseness, cha
 	    	printf("%d, %f, %f, %f, %f, %f, %f %f\n", t, net_var_t[0],
                 net_var_t[1], net_var_t[2], net_var_t[3], net_var_t[4], net_var_t[5], h_d);
 
-            vector<double> win_output = mdCalculateWin(x_win, sparseness, V_o, V_tp);
-
-            FILE * winFile = fopen (file_win,"a");
+            const vector<double> & win_output = mdCalculateWin(x_win, sparseness, V_o, V_tp);
 
             //Printing mesoscopic results for the specified mesoscopic blocks in x_win
-            for (int bi=0; bi < x_win; bi++) {
-                fprintf(winFile, "%f, ", win_output[bi]);
+            if (winFile.isOpen()) {
+                for (int bi=0; bi < x_win; bi++) {
+                    winFile.print("%f, ", win_output[bi]);
+                }
+                winFile.print("\n");
             }
-            fprintf(winFile, "\n");
-
-            fclose(winFile);
 
-            mdtimeEvolution(t, h_d, net_var_t, file_time); //Print results for each time t
+            if (tFile.isOpen())
+                mdtimeEvolution(t, h_d, net_var_t, tFile); //Print results for each time t
 
 	    }
 
         //if stop criterion is true update macroscopic results (m,d) and finish updating
 		if (md_eq == true) {
 	        net_var = net_var_t;
+	        mdExact(blocks, V_o, V_tp, net_var.data());
             net_var.push_back(t);
+            net_var.push_back(period);
             break;
 	    }
         else {
@@ -812,98 +1896,592 @@ vector<double> Network::updateNet(int s_time, int blocks, double sparseness, cha
         //If maximum time is reached store macroscopic results (m,d) and finish updating
 		if (t == s_time-1) {
 
-		    vector<double> net_var_t = mdCalculate(blocks, sparseness, V_o, V_tp);
-
 		    net_var = net_var_t;
+		    mdExact(blocks, V_o, V_tp, net_var.data());
             net_var.push_back(t);
+            net_var.push_back(period);
 
 		}
 
 	}
 
+    if (profile != NULL && net_var.size() > 6) {
+        profile->addProbe((int)net_var[6] + 1, step_flips);
+        profile->addMemory(memoryUse());
+    }
+    trace_pattern = 0; //Every traced probe is named
+
     //return macroscopic results (m,d)
     return net_var;
 
 }
 
-//Overlap calculation for mesoscopic blocks
-vector<double> Network::mdCalculateWin(int bn, double sparseness, vector<bool> & V_in1, vector<bool> & V_in2) {
+//Updates the state and threshold of nodes [n0, n1) from the packed previous state vp
+void Network::updateRange(int n0, int n1, const uint64_t * vp, const StepTable & tab, int tw) {
+    switch (w_precision) {
+        case 'f': updateRangeT(n0, n1, vp, tab, W_f.data(), 1.0, tw); break;
+        case 'i': updateRangeT(n0, n1, vp, tab, W_i.data(), w_scale, tw); break;
+        default: updateRangeT(n0, n1, vp, tab, w_p, 1.0, tw); break;
+    }
+}
 
-    int splitcut = neurons/bn; //Calculates block size
+template <class Wt>
+void Network::updateRangeT(int n0, int n1, const uint64_t * vp, const StepTable & tab,
+    const Wt * Wv, double scale, int tw) {
 
-    vector<double> overlap_b(bn); //mesoscopic overlaps vector
+	vector<int> buf(lattice ? max_row : 0); //Row of an implicit lattice
+	tiledRuns(n0, n1, tw, [&](int r0, int r1) {
+	for (int n = r0; n < r1; n++) {
 
-    vector<double> q_b(bn); //mesoscopic pattern activity vector
+		double neural_field = 0.0; //Neural field calculated for each node n
+		int count = 0; //Active neighbors of node n
 
-    vector<double> q_net(bn); //mesoscopic network activity vector
+		const int * Cn = row(n, buf.data()); //Adjacency row of node n
+		const Wt * Wn = Wv + off_p[n]; //Weights of node n
+		int kn = off_p[n+1] - off_p[n];
 
-    double q_std_factor = (neurons/bn);
+        //Calculating local activity of the k-neighbors of node n
+        for (int k = 0; k < kn; k++) {
+            count += bitAt(vp, Cn[k]);
+        }
 
-	//Calculating mesoscopic overlaps for each block
-	for (int b = 0; b < bn; b++) {
-	    q_b[b] = 0;
-	    q_net[b] = 0;
-	    overlap_b[b] = 0;
-        for (int i = b*splitcut; i < ((b+1)*splitcut); i++) {
-             q_b[b] += V_in1[i];
-             q_net[b] += V_in2[i];
+        //Avoids division by zero when patterns are very sparse
+        if (count != 0) {
+
+            double local_activity = tab.activity[count]; //Local activity of node n neighborhood
+
+            //Calculating neural field of node n
+            for (int k = 0; k < kn; k++) {
+
+                neural_field += Wn[k] * (bitAt(vp, Cn[k]) - local_activity);
+
+            }
+            neural_field *= scale;
+
+            //Updating each node state V_t[n] at time t
+            V_t.set(n, nodeFires(count, neural_field, tab, TH[n]));
+
+		}
+		else {
+		    //No active neighbors: the node keeps its state (V_t may hold an older one)
+		    V_t.set(n, bitAt(vp, n));
+		}
+
+	}
+	});
+
+}
+
+//Local activity, std dev and threshold of every active neighbor count
+void Network::buildStepTable(const StepParams & sp, StepTable & tab) {
+    int nc = max_row + 1;
+    tab.activity.resize(nc);
+    tab.sd.resize(nc);
+    tab.th.resize(nc);
+    for (int c = 0; c < nc; c++) {
+        double local_activity = c;
+        local_activity /= neighbors;
+        tab.activity[c] = local_activity;
+        tab.sd[c] = sqrt(local_activity*(1.0-local_activity));
+    }
+
+    const double * la = tab.activity.data();
+    double * th = tab.th.data();
+    switch(sp.th_fun) {
+        //linear threshold function
+        case 'l':
+            for (int c = 0; c < nc; c++)
+                th[c] = cutlinearFunction(sp.sparseness, sp.th_value, la[c], sp.slope);
+        break;
+        //rho threshold function
+        case 'r':
+            for (int c = 0; c < nc; c++)
+                th[c] = rhoFunction(sp.sparseness, sp.global_activity, la[c], sp.th_value, sp.rho1);
+        break;
+        //step threshold function
+        case 's':
+            for (int c = 0; c < nc; c++)
+                th[c] = stepFunction(la[c], sp.th_value);
+        break;
+        //sine threshold function
+        case 't':
+        {
+            double th_v1 = sp.th_value/sp.rho1;
+            for (int c = 0; c < nc; c++)
+                th[c] = sinFunction(la[c], th_v1);
         }
-        q_b[b] /= q_std_factor; //Pattern activity in block b
-        q_net[b] /= q_std_factor; //Network activity in block b
-        //th_b[b] /= th_std_factor;
+        break;
+        //Step-cut threshold function
+        case 'c':
+            for (int c = 0; c < nc; c++)
+                th[c] = stepCutFunction(la[c], sp.sparseness, sp.th_value);
+        break;
+        //Unknown function: threshold left at 0
+        default:
+            for (int c = 0; c < nc; c++)
+                th[c] = 0.0;
+        break;
+    }
+}
 
-        for (int i = b*splitcut; i < ((b+1)*splitcut); i++) {
-            overlap_b[b] += (V_in1[i]-q_b[b])*(V_in2[i]-q_net[b]);
+void Network::setDeltaUpdate(bool on) {
+    delta = on;
+    if (delta == false) {
+        //Frees the reverse adjacency and the running sums
+        vector<int>().swap(rev_off);
+        vector<int>().swap(rev_node);
+        vector<int>().swap(rev_edge);
+        vector<int>().swap(d_count);
+        vector<double>().swap(d_sum);
+        vector<double>().swap(d_wsum);
+        vector<double>().swap(d_abs);
+    }
+}
+
+//Reverse adjacency by a counting sort of the edges on the node they read
+void Network::buildReverse() {
+    int edges = off_p[neurons];
+    vector<int> buf(max_row); //Row of an implicit lattice
+    rev_off.assign(neurons+1, 0);
+    for (int n = 0; n < neurons; n++) {
+        const int * Cn = row(n, buf.data());
+        for (int k = 0; k < off_p[n+1] - off_p[n]; k++)
+            rev_off[Cn[k]+1]++;
+    }
+    for (int n = 0; n < neurons; n++)
+        rev_off[n+1] += rev_off[n];
+
+    rev_node.resize(edges);
+    rev_edge.resize(edges);
+    vector<int> pos(rev_off.begin(), rev_off.end() - 1);
+    for (int n = 0; n < neurons; n++) {
+        const int * Cn = row(n, buf.data());
+        for (int e = off_p[n]; e < off_p[n+1]; e++) {
+            int p = pos[Cn[e - off_p[n]]]++;
+            rev_node[p] = n;
+            rev_edge[p] = e;
         }
+    }
 
-        overlap_b[b] /= ((neurons/bn)*(sqrt(q_b[b] * (1 - q_b[b])) * sqrt(q_net[b] * (1 - q_net[b])) ));
+    d_count.resize(neurons);
+    d_sum.resize(neurons);
+    d_wsum.resize(neurons);
+    d_abs.resize(neurons);
+    d_mark.assign(neurons, 0);
+}
 
-	}
+void Network::deltaInitState(const uint64_t * vs) {
+    switch (w_precision) {
+        case 'f': deltaInit(vs, W_f.data(), 1.0); break;
+        case 'i': deltaInit(vs, W_i.data(), w_scale); break;
+        default: deltaInit(vs, w_p, 1.0); break;
+    }
+}
 
-	return overlap_b;
+int Network::deltaStep(const uint64_t * vp, const StepTable & tab, bool all, int steps, int & active) {
+    switch (w_precision) {
+        case 'f': return deltaStepT(vp, tab, all, steps, active, W_f.data(), 1.0);
+        case 'i': return deltaStepT(vp, tab, all, steps, active, W_i.data(), w_scale);
+        default: return deltaStepT(vp, tab, all, steps, active, w_p, 1.0);
+    }
+}
 
+template <class Wt>
+void Network::deltaInit(const uint64_t * vs, const Wt * Wv, double scale) {
+    int nchunks = (neurons + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+    pool->parallelFor(nchunks, [&](int c) {
+        int n0 = c * SWEEP_CHUNK;
+        int n1 = min(neurons, n0 + SWEEP_CHUNK);
+        vector<int> buf(lattice ? max_row : 0); //Row of an implicit lattice
+        for (int n = n0; n < n1; n++) {
+            int count = 0;
+            double sum = 0.0, wsum = 0.0, abs_sum = 0.0;
+            const int * Cn = row(n, buf.data());
+            const Wt * Wn = Wv + off_p[n];
+            for (int k = 0; k < off_p[n+1] - off_p[n]; k++) {
+                double w = Wn[k];
+                int v = bitAt(vs, Cn[k]);
+                count += v;
+                sum += v ? w : 0.0;
+                wsum += w;
+                abs_sum += fabs(w);
+            }
+            d_count[n] = count;
+            d_sum[n] = sum;
+            d_wsum[n] = wsum;
+            d_abs[n] = abs_sum * scale;
+        }
+    });
+    for (size_t i = 0; i < d_dirty.size(); i++)
+        d_mark[d_dirty[i]] = 0;
+    d_dirty.clear();
 }
 
-//Macroscopic overlap calculation
-vector<double> Network::mdCalculate(int bn, double sparseness, vector<bool> & V_in1, vector<bool> & V_in2) {
+template <class Wt>
+int Network::deltaStepT(const uint64_t * vp, const StepTable & tab, bool all, int steps, int & active,
+    const Wt * Wv, double scale) {
 
-    int splitcut = neurons/bn; //Calculates block size
+    /*
+    Rounding bound of the decision value of a node with std dev sd, relative to its sum of |W|:
+    the running sum gathers at most K rounded updates per step, the synchronous sum K
+    roundings, and the normalization and threshold a few relative ones
+    */
+    double eps = 2.3e-16; //Above DBL_EPSILON
+    double sum_err = eps * (neighbors * (steps + 4) + 16);
+
+    //Decides node n from its running sums, or as the synchronous sweep when too close to call
+    auto evaluate = [&](int n) {
+        int count = d_count[n];
+        if (count == 0)
+            return; //State and threshold kept, as in the sweep
+        double field = (d_sum[n] - tab.activity[count] * d_wsum[n]) * scale;
+        double th;
+        bool fires = nodeFires(count, field, tab, th);
+
+        double norm = tab.sd[count] * neighbors;
+        double value = field / norm - th;
+        double margin = 2.0 * (d_abs[n] * sum_err / norm + 16 * eps * (fabs(field / norm) + fabs(th)));
+        if (fabs(value) <= margin) {
+            updateRangeT(n, n+1, vp, tab, Wv, scale, 0);
+            return;
+        }
+        V_t.set(n, fires);
+        TH[n] = th;
+    };
+
+    d_flips.clear();
+    if (all) {
+        int nchunks = (neurons + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+        pool->parallelFor(nchunks, [&](int c) {
+            int n0 = c * SWEEP_CHUNK;
+            int n1 = min(neurons, n0 + SWEEP_CHUNK);
+            for (int n = n0; n < n1; n++)
+                evaluate(n);
+        });
+        //Flipped nodes from the changed words
+        const uint64_t * vt = V_t.data();
+        for (int w = 0; w < V_t.nwords(); w++) {
+            uint64_t x = vt[w] ^ vp[w];
+            while (x) {
+                d_flips.push_back(w * 64 + __builtin_ctzll(x));
+                x &= x - 1;
+            }
+        }
+    }
+    else {
+        for (size_t i = 0; i < d_dirty.size(); i++) {
+            int n = d_dirty[i];
+            evaluate(n);
+            if (V_t.get(n) != (bool)bitAt(vp, n))
+                d_flips.push_back(n);
+        }
+    }
+    for (size_t i = 0; i < d_dirty.size(); i++)
+        d_mark[d_dirty[i]] = 0;
+    d_dirty.clear();
+
+    //Pushes the flips to the nodes reading them, which are evaluated in the next step
+    for (size_t i = 0; i < d_flips.size(); i++) {
+        int j = d_flips[i];
+        int d = V_t.get(j) ? 1 : -1;
+        active += d;
+        for (int r = rev_off[j]; r < rev_off[j+1]; r++) {
+            int n = rev_node[r];
+            d_count[n] += d;
+            d_sum[n] += d * (double)Wv[rev_edge[r]];
+            if (d_mark[n] == 0) {
+                d_mark[n] = 1;
+                d_dirty.push_back(n);
+            }
+        }
+    }
 
-    vector<double> overlap_b(bn); //mesoscopic overlaps vector
+    return (int)d_flips.size();
+}
 
-    vector<double> q_b(bn); //mesoscopic pattern activity vector
+/*
+Normalizes the neural field of a node, looks up its dynamic threshold
+and returns its new state
+*/
+inline bool Network::nodeFires(int count, double neural_field, const StepTable & tab, double & th) {
 
-    vector<double> q_net(bn); //mesoscopic network activity vector
+    neural_field /= tab.sd[count]; //Std dev of local_activity
 
-    vector<double> th_b(bn); //mesoscopic threshold vector
+    neural_field /= neighbors;
 
-    double q_std_factor = (neurons/bn);
-    double th_std_factor = (neurons/bn);
+    th = tab.th[count];
 
-    //Calculating mesoscopic overlaps for each block
-	for (int b = 0; b < bn; b++) {
-	    q_b[b] = 0;
-	    q_net[b] = 0;
-	    th_b[b] = 0;
-	    overlap_b[b] = 0;
-        for (int i = b*splitcut; i < ((b+1)*splitcut); i++) {
-             q_b[b] += V_in1[i];
-             q_net[b] += V_in2[i];
-             th_b[b] += TH[i];
+    neural_field -= th;
+
+    return neural_field >= 0;
+
+}
+
+//Queues the loaded pattern V_o and the initial state V_t as a probe of updateNetBatch
+void Network::queueProbe() {
+    batch_V_o.push_back(V_o);
+    batch_V_t.push_back(V_t);
+}
+
+//Evolves the queued probes in batches of 64 and clears the queue
+vector< vector<double> > Network::updateNetBatch(int s_time, int blocks, double sparseness, char th_fun,
+    double th_value, double rho) {
+
+    StepParams sp;
+    sp.th_fun = th_fun;
+    sp.sparseness = sparseness;
+    sp.th_value = th_value;
+    sp.slope = ((-2)*th_value) / (1 - 2 * sparseness);
+    sp.global_activity = 0.0;
+    sp.rho1 = rho;
+
+    packWeights();
+
+    int nq = batch_V_o.size();
+    vector< vector<double> > out(nq);
+    for (int first = 0; first < nq; first += 64) {
+        int nprobes = min(64, nq - first);
+        switch (w_precision) {
+            case 'f': updateBatch64(first, nprobes, s_time, blocks, sp, rho, out, W_f.data(), 1.0); break;
+            case 'i': updateBatch64(first, nprobes, s_time, blocks, sp, rho, out, W_i.data(), w_scale); break;
+            default: updateBatch64(first, nprobes, s_time, blocks, sp, rho, out, w_p, 1.0); break;
         }
+    }
 
-        q_b[b] /= q_std_factor;
-        q_net[b] /= q_std_factor;
-        th_b[b] /= th_std_factor;
+    if (profile != NULL)
+        profile->addMemory(memoryUse()); //Before the queue is released
 
-        for (int i = b*splitcut; i < ((b+1)*splitcut); i++) {
-            overlap_b[b] += (V_in1[i]-q_b[b])*(V_in2[i]-q_net[b]);
+    batch_V_o.clear();
+    batch_V_t.clear();
+
+    return out;
+
+}
+
+/*
+Bit-sliced update of probes [first, first+nprobes) of the queue.
+Word S[n] holds node n of every probe (bit p for probe first+p), so the row of
+node n is read once for all probes: a first pass counts the active neighbors of
+every probe with a bit-sliced adder and a second pass accumulates the neural
+field of every probe with the same operations as updateRange.
+Every probe follows the same steps, statistics and stop criterion as updateNet;
+a probe is retired from the alive mask as soon as it stops.
+*/
+template <class Wt>
+void Network::updateBatch64(int first, int nprobes, int s_time, int blocks, const StepParams & sp0,
+    double rho, vector< vector<double> > & out, const Wt * Wv, double scale) {
+
+    int nwords = (neurons + 63) / 64;
+    uint64_t alive = nprobes == 64 ? ~(uint64_t)0 : (((uint64_t)1 << nprobes) - 1); //Probes still running
+
+    //Bit-sliced current and next states
+    vector<uint64_t> S(nwords*64, 0);
+    vector<uint64_t> S_next(nwords*64, 0);
+    uint64_t a[64];
+    for (int w = 0; w < nwords; w++) {
+        for (int p = 0; p < 64; p++)
+            a[p] = p < nprobes ? batch_V_t[first+p].data()[w] : 0;
+        transpose64(a);
+        for (int i = 0; i < 64; i++)
+            S[w*64 + i] = a[i];
+    }
+
+    //Planes of the bit-sliced neighbor counter
+    int nplanes = 1;
+    while ((1 << nplanes) <= max_row)
+        nplanes++;
+
+    vector<BitState> V_p(nprobes, BitState(neurons)); //Packed state of each probe
+    vector<BitState> V_prev(nprobes, BitState(neurons)); //State of the previous statistics of each probe
+    vector< vector<double> > net_var(nprobes, vector<double>(6, 0.0)); //Statistics at t-1
+    vector<double> net_var_t(6); //Statistics of a probe at t
+    vector<StepParams> lane_sp(64, sp0); //Step constants of each probe
+    vector<StepTable> lane_tab(64); //Step table of each probe
+    vector<StateHistory> history(cycle_window > 0 ? nprobes : 0, StateHistory(cycle_window, nwords));
+
+    int nchunks = (neurons + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+    int tw = tileWidth(8.0, SWEEP_CHUNK / max(grid_width, 1) + 1); //Tiles of the bit-sliced state
+
+    for (int t = 0; t < s_time && alive != 0; t++) {
+
+        //Unpacks the state of the running probes
+        for (int w = 0; w < nwords; w++) {
+            for (int i = 0; i < 64; i++)
+                a[i] = S[w*64 + i];
+            transpose64(a);
+            for (int p = 0; p < nprobes; p++)
+                if ((alive >> p) & 1)
+                    V_p[p].data()[w] = a[p];
+        }
+
+        double rho1 = t < 20 ? 1.0/rho : rho;
+
+        //Statistics and stop criterion of every probe
+        for (int p = 0; p < nprobes; p++) {
+            if (((alive >> p) & 1) == 0)
+                continue;
+
+            blockSums(blocks, batch_V_o[first+p], V_p[p], false, md_sums);
+            mdFromSums(md_sums, net_var_t.data());
+
+            bool md_eq = t > 0 && mdStop(blocks, batch_V_o[first+p], V_prev[p], V_p[p], net_var[p], net_var_t);
+            V_prev[p] = V_p[p];
+            int period = 0;
+            if (cycle_window > 0) {
+                period = history[p].push(V_p[p].data());
+                if (period > 0 && (t - period >= 20 || (sp0.th_fun != 'r' && sp0.th_fun != 't')))
+                    md_eq = true;
+                else
+                    period = 0;
+            }
+
+            if (md_eq == true || t == s_time-1) {
+                out[first+p] = net_var_t;
+                mdExact(blocks, batch_V_o[first+p], V_p[p], out[first+p].data());
+                if (profile != NULL)
+                    profile->addProbe(t + 1, vector<int>());
+                out[first+p].push_back(t);
+                out[first+p].push_back(period);
+                alive &= ~((uint64_t)1 << p);
+                continue;
+            }
+            net_var[p] = net_var_t;
+
+            lane_sp[p].global_activity = V_p[p].count();
+            lane_sp[p].global_activity /= neurons;
+            lane_sp[p].rho1 = rho1;
+            buildStepTable(lane_sp[p], lane_tab[p]);
         }
 
-        overlap_b[b] /= ((neurons/bn)*(sqrt(q_b[b] * (1 - q_b[b])) * sqrt(q_net[b] * (1 - q_net[b])) ));
+        if (alive == 0)
+            break;
+
+        //Updating the nodes of all the running probes
+        pool->parallelFor(nchunks, [&](int c) {
+            int n0 = c * SWEEP_CHUNK;
+            int n1 = min(neurons, n0 + SWEEP_CHUNK);
+            double local_activity[64], neural_field[64]; //Local activity and field of each probe
+            int counts[64]; //Active neighbors of each probe
+            double diff[64][2]; //V_k - local_activity for inactive and active neighbors
+            int lanes[64]; //Running probes with active neighbors
+            vector<int> buf(lattice ? max_row : 0); //Row of an implicit lattice
+
+            tiledRuns(n0, n1, tw, [&](int r0, int r1) {
+            for (int n = r0; n < r1; n++) {
+                const int * Cn = row(n, buf.data());
+                const Wt * Wn = Wv + off_p[n];
+                int kn = off_p[n+1] - off_p[n];
+
+                //Counting the active neighbors of every probe
+                uint64_t planes[32] = {0}; //Bit-sliced active neighbors count
+                for (int k = 0; k < kn; k++) {
+                    uint64_t carry = S[Cn[k]];
+                    for (int i = 0; carry != 0 && i < nplanes; i++) {
+                        uint64_t c_i = planes[i] & carry;
+                        planes[i] ^= carry;
+                        carry = c_i;
+                    }
+                }
+
+                int nl = 0;
+                uint64_t y = alive;
+                while (y != 0) {
+                    int p = __builtin_ctzll(y);
+                    y &= y - 1;
+
+                    int count = 0;
+                    for (int i = 0; i < nplanes; i++)
+                        count |= (int)((planes[i] >> p) & 1) << i;
+
+                    counts[p] = count;
+                    local_activity[p] = lane_tab[p].activity[count];
+                    if (count != 0) {
+                        diff[p][0] = 0 - local_activity[p];
+                        diff[p][1] = 1 - local_activity[p];
+                        neural_field[p] = 0.0;
+                        lanes[nl++] = p;
+                    }
+                }
+
+                //Neural field of the probes with active neighbors
+                for (int k = 0; k < kn; k++) {
+                    uint64_t x = S[Cn[k]];
+                    double w = Wn[k];
+                    for (int l = 0; l < nl; l++) {
+                        int p = lanes[l];
+                        neural_field[p] += w * diff[p][(x >> p) & 1];
+                    }
+                }
+
+                uint64_t updated = 0, fired = 0;
+                for (int l = 0; l < nl; l++) {
+                    int p = lanes[l];
+                    double th = 0.0;
+                    updated |= (uint64_t)1 << p;
+                    if (nodeFires(counts[p], neural_field[p] * scale, lane_tab[p], th))
+                        fired |= (uint64_t)1 << p;
+                }
+
+                S_next[n] = (S[n] & ~updated) | fired;
+            }
+            });
+        });
+
+        S.swap(S_next);
+
+    }
+
+}
+
+//Overlap calculation for mesoscopic blocks
+const vector<double> & Network::mdCalculateWin(int bn, double sparseness, BitState & V_in1, BitState & V_in2) {
+
+    int splitcut = neurons/bn; //Calculates block size
+
+    win_overlap.resize(bn); //mesoscopic overlaps vector
+
+    double q_std_factor = (neurons/bn);
+
+    blockSums(bn, V_in1, V_in2, false, win_sums);
+
+	//Calculating mesoscopic overlaps for each block
+	for (int b = 0; b < bn; b++) {
+	    double q_b = win_sums.n1[b]; //Pattern activity in block b
+	    double q_net = win_sums.n2[b]; //Network activity in block b
+        q_b /= q_std_factor;
+        q_net /= q_std_factor;
+
+        win_overlap[b] = blockOverlap(win_sums.n1[b], win_sums.n2[b], win_sums.n12[b], splitcut, q_b, q_net);
+
+        win_overlap[b] /= ((neurons/bn)*(sqrt(q_b * (1 - q_b)) * sqrt(q_net * (1 - q_net)) ));
 
 	}
 
+	return win_overlap;
+
+}
+
+//Macroscopic overlap calculation
+vector<double> Network::mdCalculate(int bn, double sparseness, BitState & V_in1, BitState & V_in2) {
+
+    blockSums(bn, V_in1, V_in2, true, md_sums);
+
+    vector<double> o_v(6);
+    mdFromSums(md_sums, o_v.data());
+    return o_v;
+
+}
+
+//Macroscopic overlap, activity and threshold statistics from the block sums
+void Network::mdFromSums(const BlockSums & bs, double * md) {
+
+    int bn = bs.bn;
+
+    int splitcut = neurons/bn; //Calculates block size
+
+    double q_std_factor = (neurons/bn);
+    double th_std_factor = (neurons/bn);
+
 	double m = 0;
 	double d_s = 0;
 
@@ -913,17 +2491,32 @@ vector<double> Network::mdCalculate(int bn, double sparseness, vector<bool> & V_
 	double th_m = 0;
 	double th_d_s = 0;
 
-    //Calculating global overlaps and activity as mean and variance over the blocks
-    for (int b=0; b < bn; b++) {
-        m += overlap_b[b];
-        d_s += pow(overlap_b[b], 2);
+    /*
+    Calculating mesoscopic overlaps for each block, and the global overlaps
+    and activity as mean and variance over the blocks
+    */
+	for (int b = 0; b < bn; b++) {
+	    double q_b = bs.n1[b]; //Pattern activity in block b
+	    double q_net = bs.n2[b]; //Network activity in block b
+	    double th_b = bs.th_sum[b]; //Mean threshold in block b
 
-        q_m += q_net[b];
-        q_d_s += pow(q_net[b],2);
+        q_b /= q_std_factor;
+        q_net /= q_std_factor;
+        th_b /= th_std_factor;
 
-        th_m += th_b[b];
-        th_d_s += pow(th_b[b],2);
-    }
+        double overlap_b = blockOverlap(bs.n1[b], bs.n2[b], bs.n12[b], splitcut, q_b, q_net);
+
+        overlap_b /= ((neurons/bn)*(sqrt(q_b * (1 - q_b)) * sqrt(q_net * (1 - q_net)) ));
+
+        m += overlap_b;
+        d_s += pow(overlap_b, 2);
+
+        q_m += q_net;
+        q_d_s += pow(q_net,2);
+
+        th_m += th_b;
+        th_d_s += pow(th_b,2);
+	}
 
     m /= bn;
     double d = sqrt(d_s/bn - pow(m, 2));
@@ -934,27 +2527,148 @@ vector<double> Network::mdCalculate(int bn, double sparseness, vector<bool> & V_
     th_m /= bn;
     double th_d = sqrt(th_d_s/bn - pow(th_m, 2));
 
-    vector<double> o_v;
+    md[0] = m;
+    md[1] = d;
+    md[2] = q_m;
+    md[3] = q_d;
+    md[4] = th_m;
+    md[5] = th_d;
 
-    o_v.push_back(m);
-    o_v.push_back(d);
-    o_v.push_back(q_m);
-    o_v.push_back(q_d);
-    o_v.push_back(th_m);
-    o_v.push_back(th_d);
+}
 
-    return o_v;
+void Network::blockSegments(int bn, BlockSums & bs) {
+    if (bs.bn == bn)
+        return;
+
+    int splitcut = neurons/bn; //Block size
+    int covered = splitcut*bn; //Nodes in some block
+    int nchunks = (covered + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+
+    bs.bn = bn;
+    bs.seg_first.assign(nchunks+1, 0);
+    bs.seg_block.clear();
+    bs.seg_a.clear();
+    bs.seg_b.clear();
+    for (int c = 0; c < nchunks; c++) {
+        bs.seg_first[c] = bs.seg_block.size();
+        int a = c * SWEEP_CHUNK;
+        int e = min(covered, a + SWEEP_CHUNK);
+        while (a < e) {
+            int b = a / splitcut;
+            int end = min(e, (b+1)*splitcut);
+            bs.seg_block.push_back(b);
+            bs.seg_a.push_back(a);
+            bs.seg_b.push_back(end);
+            a = end;
+        }
+    }
+    bs.seg_first[nchunks] = bs.seg_block.size();
+
+    int nseg = bs.seg_block.size();
+    bs.s1.assign(nseg, 0);
+    bs.s2.assign(nseg, 0);
+    bs.s12.assign(nseg, 0);
+    bs.sth.assign(nseg, 0.0);
+    bs.n1.assign(bn, 0);
+    bs.n2.assign(bn, 0);
+    bs.n12.assign(bn, 0);
+    bs.th_sum.assign(bn, 0.0);
+}
+
+void Network::chunkSums(BlockSums & bs, int c, const BitState & V_in1, const BitState & V_in2, bool with_th) {
+    if (c >= (int)bs.seg_first.size() - 1)
+        return; //Chunk past the covered nodes
+
+    //Segments of original node numbers, gathered from the renumbered nodes
+    if (renumbered()) {
+        for (int sg = bs.seg_first[c]; sg < bs.seg_first[c+1]; sg++) {
+            int s1 = 0, s2 = 0, s12 = 0;
+            double th = 0;
+            for (int i = bs.seg_a[sg]; i < bs.seg_b[sg]; i++) {
+                int j = new_id[i];
+                int x1 = V_in1.get(j), x2 = V_in2.get(j);
+                s1 += x1;
+                s2 += x2;
+                s12 += x1 & x2;
+                if (with_th)
+                    th += TH[j];
+            }
+            bs.s1[sg] = s1;
+            bs.s2[sg] = s2;
+            bs.s12[sg] = s12;
+            bs.sth[sg] = th;
+        }
+        return;
+    }
+
+    for (int sg = bs.seg_first[c]; sg < bs.seg_first[c+1]; sg++) {
+        bs.s1[sg] = V_in1.countRange(bs.seg_a[sg], bs.seg_b[sg]);
+        bs.s2[sg] = V_in2.countRange(bs.seg_a[sg], bs.seg_b[sg]);
+        bs.s12[sg] = V_in1.countAndRange(V_in2, bs.seg_a[sg], bs.seg_b[sg]);
+        double th = 0;
+        if (with_th) {
+            for (int i = bs.seg_a[sg]; i < bs.seg_b[sg]; i++)
+                th += TH[i];
+        }
+        bs.sth[sg] = th;
+    }
+}
 
+void Network::reduceSums(BlockSums & bs) {
+    fill(bs.n1.begin(), bs.n1.end(), 0);
+    fill(bs.n2.begin(), bs.n2.end(), 0);
+    fill(bs.n12.begin(), bs.n12.end(), 0);
+    fill(bs.th_sum.begin(), bs.th_sum.end(), 0.0);
+    for (size_t sg = 0; sg < bs.seg_block.size(); sg++) {
+        bs.n1[bs.seg_block[sg]] += bs.s1[sg];
+        bs.n2[bs.seg_block[sg]] += bs.s2[sg];
+        bs.n12[bs.seg_block[sg]] += bs.s12[sg];
+        bs.th_sum[bs.seg_block[sg]] += bs.sth[sg];
+    }
+}
+
+/*
+Block sums of mdCalculate and mdCalculateWin, in a pass of their own.
+The covered nodes are cut into segments at chunk and block boundaries, the
+chunks are counted in parallel and the segments are reduced in node order,
+so the sums do not depend on the number of threads.
+*/
+void Network::blockSums(int bn, const BitState & V_in1, const BitState & V_in2, bool with_th, BlockSums & bs) {
+
+    blockSegments(bn, bs);
+
+    int nchunks = bs.seg_first.size() - 1;
+    pool->parallelFor(nchunks, [&](int c) {
+        chunkSums(bs, c, V_in1, V_in2, with_th);
+    });
+
+    reduceSums(bs);
+
+}
+
+/*
+Sum of (x1-q1)*(x2-q2) over a block of L neurons from its active counts,
+expanded as n12 - q2*n1 - q1*n2 + L*q1*q2 so the block is reduced with popcounts
+*/
+double Network::blockOverlap(int n1, int n2, int n12, int L, double q1, double q2) {
+    return n12 - q2*n1 - q1*n2 + L*q1*q2;
 }
 
 /*
 Calculates the mean activity of the input vector
 Use to calculate the activity of patterns and network states
 */
-double Network::vectorMean(vector<bool> & V_in) {
-    double sum_vec = 0.0;
-    for (int ni = 0; ni < neurons; ni++)
-        sum_vec += V_in[ni];
+double Network::vectorMean(BitState & V_in) {
+    double sum_vec = V_in.count();
+    return sum_vec / neurons;
+}
+
+double Network::patternMean(const uint64_t * pattern) {
+    int nw = (neurons + 63) / 64;
+    int sum = 0;
+    for (int w = 0; w < nw; w++)
+        sum += popCount(pattern[w]);
+    double sum_vec = sum;
     return sum_vec / neurons;
 }
 
@@ -965,6 +2679,70 @@ Stopping criteria: If the values are the same then network update stops
 if not
 network continue updating until reaching the specified maximum updating time
 */
+void Network::mdExact(int bn, const BitState & V_in1, const BitState & V_in2, double * md) {
+
+    int splitcut = neurons/bn; //Calculates block size
+
+    double q_std_factor = (neurons/bn);
+
+    double m = 0;
+    double d_s = 0;
+
+    double q_m = 0;
+    double q_d_s = 0;
+
+    for (int b = 0; b < bn; b++) {
+        int n1 = 0, n2 = 0;
+        for (int i = b*splitcut; i < ((b+1)*splitcut); i++) {
+            int j = renumbered() ? new_id[i] : i; //Original node order
+            n1 += V_in1.get(j);
+            n2 += V_in2.get(j);
+        }
+        double q_b = n1;
+        double q_net = n2;
+        q_b /= q_std_factor;
+        q_net /= q_std_factor;
+
+        //(x1-q_b)*(x2-q_net) of the four node cases, indexed by 2*x1+x2
+        double term[4] = {(0-q_b)*(0-q_net), (0-q_b)*(1-q_net), (1-q_b)*(0-q_net), (1-q_b)*(1-q_net)};
+        double overlap_b = 0;
+        for (int i = b*splitcut; i < ((b+1)*splitcut); i++) {
+            int j = renumbered() ? new_id[i] : i;
+            overlap_b += term[2*V_in1.get(j) + V_in2.get(j)];
+        }
+
+        overlap_b /= ((neurons/bn)*(sqrt(q_b * (1 - q_b)) * sqrt(q_net * (1 - q_net)) ));
+
+        m += overlap_b;
+        d_s += pow(overlap_b, 2);
+
+        q_m += q_net;
+        q_d_s += pow(q_net,2);
+    }
+
+    m /= bn;
+    md[0] = m;
+    md[1] = sqrt(d_s/bn - pow(m, 2));
+
+    q_m /= bn;
+    md[2] = q_m;
+    md[3] = sqrt(q_d_s/bn - pow(q_m, 2));
+
+}
+
+bool Network::mdStop(int bn, const BitState & V_in1, const BitState & prev, const BitState & cur,
+    vector<double> & md_prev, vector<double> & md_t) {
+    //Different popcount statistics come from different block counts, the exact ones differ too
+    if (mdComparison(md_prev, md_t) == false)
+        return false;
+    if (cur.hamming(prev) == 0)
+        return true;
+    vector<double> exact_prev(md_prev), exact_t(md_t);
+    mdExact(bn, V_in1, prev, exact_prev.data());
+    mdExact(bn, V_in1, cur, exact_t.data());
+    return mdComparison(exact_prev, exact_t);
+}
+
 bool Network::mdComparison(vector<double> & v1, vector<double> & v2) {
     bool md_equality = false;
     int counter = 0;
@@ -981,13 +2759,22 @@ bool Network::mdComparison(vector<double> & v1, vector<double> & v2) {
 // Reset the random number generator with the system clock.
 void Network::seed()
 {
-    srand(time(NULL));
+    seed(time(NULL), 0);
 }
 
-// return a uniform number in [0,1].
+// Keys the random streams of the network by the run seed and its module
+void Network::seed(uint64_t seed_value, int module)
+{
+    rng_seed = seed_value;
+    rng_module = module;
+    noise_probe = 0;
+    rng_net = RandomStream(rng_seed, rng_module, 0, RNG_NETWORK);
+}
+
+// return a uniform number in [0,1).
 double Network::unifRand()
 {
-    return rand() / double(RAND_MAX + 1.0);
+    return rng_net.unif();
 }
 
 /*
@@ -996,8 +2783,8 @@ avoid duplicated connections
 */
 bool Network::searchValue(int cij_value, int node) {
 	bool found = false;
-	for (int j = 0; j < neighbors; j++) {
-		if (C[node][j] == cij_value) {
+	for (int j = C_off[node]; j < C_off[node+1]; j++) {
+		if (C[j] == cij_value) {
 			found = true;
 			break;
 		}
@@ -1024,7 +2811,7 @@ void Network::printNetworkState(const char * file, int width) {
     //fprintf(vsFile, "%d",(int)V_tp[0]);
 
     for (int i = 0; i < neurons; i++) {
-		fprintf(vsFile, "%d ",(int)V_t[i]);
+		fprintf(vsFile, "%d ",(int)V_t.get(renumbered() ? new_id[i] : i));
 		if ((i+1) % width == 0) {
 		    fprintf(vsFile, "\n");
 		}
@@ -1109,24 +2896,40 @@ void Network::thetaZero(double sparseness) {
     THETA_0 = (1-2*sparseness)/(2*sqrt(std_factor));
 }
 
+//Appends the state of step t to the trace, XOR coded against the previous step
+void Network::traceStep(int t) {
+    //State in the original node numbering
+    const BitState * v = &V_tp;
+    if (renumbered()) {
+        perm_buf.assign(neurons, 0);
+        for (int i = 0; i < neurons; i++)
+            perm_buf.set(i, V_tp.get(new_id[i]));
+        v = &perm_buf;
+    }
+    bool key = t % TRACE_KEYFRAME == 0;
+    encodeStateDelta(v->data(), key ? NULL : trace_prev.data(), v->nwords(), trace_rec);
+    trace->append(trace_module, trace_pattern, trace_interval, t, key, trace_rec);
+    trace_prev = *v;
+}
+
 //Print the time evolution of the overlap to a text file
-void Network::mdtimeEvolution(int t, double hamm_dist, vector<double> & V_in, const char * file_time) {
-    FILE * tFile = fopen (file_time,"a");
-    fprintf(tFile, "%d, %f, %f, %f, %f, %f, %f, %f\n", t, V_in[0],
+void Network::mdtimeEvolution(int t, double hamm_dist, vector<double> & V_in, BufferedFile & tFile) {
+    tFile.print("%d, %f, %f, %f, %f, %f, %f, %f\n", t, V_in[0],
         V_in[1], V_in[2], V_in[3], V_in[4], V_in[5],hamm_dist);
-    fclose(tFile);
 }
 
 //Print main network parameters and the topology adjacency list to screen
 void Network::toString() {
+    detach();
+    expandTopology();
 
     cout << "N=" << neurons << ", K=" << neighbors
         << ", w=" << rewiring << endl;
     for (int i = 0; i < neurons; i++)
     {
-        for (int j = 0; j < neighbors; j++) {
-            //cout << "\"" << i << "\"" << "->" << "\"" << C[i][j] << "\"" << ", ";
-            cout << i << "->" << C[i][j] << ", ";
+        for (int j = C_off[i]; j < C_off[i+1]; j++) {
+            //cout << "\"" << i << "\"" << "->" << "\"" << C[j] << "\"" << ", ";
+            cout << i << "->" << C[j] << ", ";
         }
         cout << endl;
     }
@@ -1135,16 +2938,34 @@ void Network::toString() {
 
 //Print to screen the topology adjacency matrix to screen
 void Network::toAdjMat() {
+    detach();
+    expandTopology();
 
+    /*
+    Entry (i, j) is 1 when i is in the adjacency row of j,
+    rows of the printed matrix are the columns of the CSR lists
+    */
+    vector<int> R_off(neurons+1, 0); //Row offsets of the transposed lists
+    for (size_t e = 0; e < C.size(); e++)
+        R_off[C[e]+1]++;
+    for (int i = 0; i < neurons; i++)
+        R_off[i+1] += R_off[i];
+
+    vector<int> R(C.size()); //Transposed adjacency lists
+    vector<int> pos(R_off.begin(), R_off.end()-1);
+    for (int j = 0; j < neurons; j++)
+        for (int e = C_off[j]; e < C_off[j+1]; e++)
+            R[pos[C[e]]++] = j;
+
+    vector<char> row(neurons);
     for (int i = 0; i < neurons; i++)
     {
-        for (int j = 0; j < neurons; j++) {
+        fill_n(row.begin(), neurons, 0);
+        for (int e = R_off[i]; e < R_off[i+1]; e++)
+            row[R[e]] = 1;
 
-            bool fV=searchValue(i, j);
-            if (fV == true)
-                cout << 1 << " ";
-            else
-                cout << 0 << " ";
+        for (int j = 0; j < neurons; j++) {
+            cout << (int)row[j] << " ";
         }
         cout << endl;
     }
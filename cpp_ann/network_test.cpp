@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include "network.h"
+
+using namespace std;
+
+/*
+Checks of the square-grid topology, run with make test.
+
+Without rewiring (w=0) the rows of an 'l' network must be the ones the baseline
+read: the nodes of the (2*lSide+1)^2 window of grid node (i, j) = (n / height,
+n % height), in grid order, without the node itself, cut at K entries (a node
+outside its window, on non-square grids, leaves one node more than K). Nodes
+past the grid get empty rows.
+*/
+
+static int failures = 0;
+
+static void check(bool ok, const char * what, int N, int K, int width, int height) {
+    if (ok == false) {
+        fprintf(stderr, "FAILED: %s (N=%d K=%d %dx%d)\n", what, N, K, width, height);
+        failures++;
+    }
+}
+
+//Window of node (i, j) as the baseline generator built it, the first K are read
+static vector<int> baselineRow(int i, int j, int width, int height, int lSide) {
+    int ni = i * width + j;
+    int iI = i-lSide, iJ = j-lSide, fI = i+lSide, fJ = j+lSide;
+    if (iI < 0) { iI = 0; fI = iI + 2*lSide; }
+    if (iJ < 0) { iJ = 0; fJ = iJ + 2*lSide; }
+    if (fI >= height) { fI = height-1; iI = fI - 2*lSide; }
+    if (fJ >= width) { fJ = width-1; iJ = fJ - 2*lSide; }
+    vector<int> Ci;
+    for (int ip=iI; ip <= fI; ip++)
+        for (int jp=iJ; jp <= fJ; jp++)
+            if (ip * width + jp != ni)
+                Ci.push_back(ip * width + jp);
+    return Ci;
+}
+
+static void checkGrid(int N, int K, int width, int height) {
+    Network net(N, K, 0.0, width, height, 'l');
+    NetworkArrays a = net.arrays();
+    int lSide = (sqrt(K+1)-1)/2;
+    bool rows = true, sizes = true;
+    for (int n = 0; n < N; n++) {
+        int kn = a.row_off[n+1] - a.row_off[n];
+        if (kn > K)
+            sizes = false;
+        vector<int> Ci;
+        if (n < width*height) {
+            Ci = baselineRow(n / height, n % height, width, height, lSide);
+            if ((int)Ci.size() > K)
+                Ci.resize(K);
+        }
+        if (kn != (int)Ci.size()) {
+            rows = false;
+            continue;
+        }
+        for (int k = 0; k < kn; k++)
+            if (a.adj[a.row_off[n] + k] != Ci[k])
+                rows = false;
+    }
+    check(sizes, "rows hold at most K neighbors", N, K, width, height);
+    check(rows, "rows are the first K window nodes of the baseline", N, K, width, height);
+}
+
+int main() {
+    checkGrid(400, 24, 20, 20);
+    checkGrid(420, 24, 20, 20); //Nodes past the grid
+    checkGrid(600, 24, 30, 20); //Nodes outside their window
+    checkGrid(600, 24, 20, 30);
+    checkGrid(600, 8, 30, 20);
+    checkGrid(600, 30, 30, 20); //Windows smaller than K
+
+    if (failures == 0)
+        printf("network_test: all checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
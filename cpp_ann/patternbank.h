@@ -0,0 +1,163 @@
+#ifndef PATTERNBANK_H_
+#define PATTERNBANK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <sys/mman.h>
+#include "bitstate.h"
+#include "threadpool.h"
+#include "patternfile.h"
+
+using namespace std;
+
+/*
+Patterns of a folder or packed pattern file (path1 or path2), each loaded once
+per process. The patterns of the run are requested first and then loaded
+together in parallel; afterwards the bank is read only and get() returns a
+packed view (neurons bits in 64-bit words, as in BitState) that any number
+of networks can learn from or start at. Views of a packed file point into
+its mapping, text patterns are parsed into one cache aligned buffer, or into
+one shared anonymous segment (setShared) so that processes forked after load()
+all read the same physical pages.
+*/
+class PatternBank {
+private:
+    string path; //pattern folder or packed pattern file
+    int neurons; //bits per pattern
+    int nwords; //64-bit words per pattern
+    PatternFile pack; //mapped file when path is a packed pattern file
+    map< pair<int, int>, int > index; //(id, interval) -> slot
+    vector< pair<int, int> > ids; //(id, interval) of every slot
+    vector<uint64_t, CacheAlignedAllocator<uint64_t> > storage; //parsed text patterns
+    bool shared; //text patterns go to segment instead of storage
+    uint64_t * segment; //shared mapping of the parsed text patterns (NULL: none)
+    size_t segment_bytes;
+    vector<const uint64_t *> views; //pattern of every slot
+    double load_seconds; //time spent in load()
+
+public:
+    PatternBank(const char * path, int neurons);
+    PatternBank(const PatternBank &) = delete;
+    PatternBank & operator=(const PatternBank &) = delete;
+    ~PatternBank();
+
+    //Parses text patterns into a shared mapping kept by forked processes, set before load()
+    void setShared(bool on) { shared = on; }
+
+    //Adds pattern <id>_<interval> to the patterns to be loaded
+    void request(int id, int interval);
+
+    //Loads the requested patterns with the given threads (0: all hardware threads)
+    void load(int threads);
+
+    //View of pattern <id>_<interval>, it must have been requested and loaded
+    const uint64_t * get(int id, int interval) const;
+
+    bool isPacked() const { return pack.isOpen(); }
+    int count() const { return (int)ids.size(); }
+    double loadSeconds() const { return load_seconds; }
+
+    //Bytes held by the pattern views (mapped pages for a packed file)
+    size_t bytes() const { return ids.size() * nwords * sizeof(uint64_t); }
+
+    //Prints the number of patterns, memory use and load time
+    void report(const char * name) const;
+};
+
+PatternBank::PatternBank(const char * path, int neurons) : path(path), neurons(neurons),
+    nwords((neurons + 63) / 64), shared(false), segment(NULL), segment_bytes(0), load_seconds(0) {
+    if (PatternFile::isPatternFile(path) == false)
+        return;
+    if (pack.open(path) == false)
+        exit(1);
+    if (pack.nbits() != neurons) {
+        fprintf(stderr, "Invalid packed pattern file %s for %d neurons\n", path, neurons);
+        exit(1);
+    }
+}
+
+PatternBank::~PatternBank() {
+    if (segment != NULL)
+        munmap(segment, segment_bytes);
+}
+
+void PatternBank::request(int id, int interval) {
+    pair<int, int> key(id, interval);
+    if (index.count(key) > 0)
+        return;
+    index[key] = ids.size();
+    ids.push_back(key);
+}
+
+void PatternBank::load(int threads) {
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+
+    int np = ids.size();
+    views.assign(np, (const uint64_t *)NULL);
+    vector<char> failed(np, 0);
+
+    if (isPacked()) {
+        for (int i = 0; i < np; i++) {
+            views[i] = pack.find(ids[i].first, ids[i].second);
+            failed[i] = views[i] == NULL;
+        }
+    }
+    else {
+        uint64_t * base;
+        if (shared) {
+            //Zero filled pages, page aligned
+            segment_bytes = max((size_t)np * nwords * sizeof(uint64_t), (size_t)1);
+            void * p = mmap(NULL, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                fprintf(stderr, "Can not map %zu bytes of shared memory for %s\n", segment_bytes, path.c_str());
+                exit(1);
+            }
+            segment = (uint64_t *)p;
+            base = segment;
+        }
+        else {
+            storage.assign((size_t)np * nwords, 0);
+            base = storage.data();
+        }
+        ThreadPool pool(threads);
+        pool.parallelFor(np, [&](int i) {
+            uint64_t * words = base + (size_t)i * nwords;
+            char file_in[256];
+            snprintf(file_in, sizeof(file_in), "%s%d_%d", path.c_str(), ids[i].first, ids[i].second);
+            failed[i] = readTextPattern(file_in, neurons, words) == false;
+            views[i] = words;
+        });
+    }
+
+    for (int i = 0; i < np; i++) {
+        if (failed[i]) {
+            fprintf(stderr, "Can not load pattern %d_%d from %s\n", ids[i].first, ids[i].second, path.c_str());
+            exit(1);
+        }
+    }
+
+    load_seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+const uint64_t * PatternBank::get(int id, int interval) const {
+    map< pair<int, int>, int >::const_iterator it = index.find(make_pair(id, interval));
+    if (it == index.end() || views.empty()) {
+        fprintf(stderr, "Pattern %d_%d was not loaded from %s\n", id, interval, path.c_str());
+        exit(1);
+    }
+    return views[it->second];
+}
+
+void PatternBank::report(const char * name) const {
+    printf("%s: %d patterns from %s (%s), %.2f MB, loaded in %.3f s\n", name, count(), path.c_str(),
+        isPacked() ? "packed" : (segment != NULL ? "text, shared" : "text"), bytes() / 1048576.0, load_seconds);
+}
+
+#endif /*PATTERNBANK_H_*/
@@ -0,0 +1,289 @@
+#ifndef PATTERNFILE_H_
+#define PATTERNFILE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+Packed pattern container.
+A single file holds many binary patterns of width x height bits:
+
+    header      PatternFileHeader
+    id table    count x PatternId, pattern i is the file <id>_<interval> of a pattern folder
+    bitmaps     count x words 64-bit words, starting at data_offset (cache line aligned),
+                bit j of a pattern is bit j%64 of its word j/64, as in BitState
+
+The file is memory mapped, so a loaded pattern is a pointer into the mapping.
+*/
+
+#define PATTERN_FILE_MAGIC "ANNPATS"
+#define PATTERN_FILE_VERSION 1
+
+struct PatternFileHeader {
+    char magic[8]; //PATTERN_FILE_MAGIC
+    uint32_t version; //PATTERN_FILE_VERSION
+    uint32_t width; //pattern width
+    uint32_t height; //pattern height
+    uint32_t count; //number of patterns
+    uint64_t nbits; //bits per pattern, width x height
+    uint64_t words; //64-bit words per pattern
+    uint64_t ids_offset; //byte offset of the id table
+    uint64_t data_offset; //byte offset of the first bitmap
+};
+
+struct PatternId {
+    int32_t id; //pattern number
+    int32_t interval; //pattern interval (digit after _)
+};
+
+//Read-only memory mapped pattern container
+class PatternFile {
+private:
+    void * base; //mapping of the whole file
+    size_t length; //mapping size
+    const PatternFileHeader * header;
+    const PatternId * ids;
+    map< pair<int, int>, int > index; //(id, interval) -> pattern number
+
+public:
+    PatternFile();
+    ~PatternFile();
+    PatternFile(const PatternFile &) = delete;
+    PatternFile & operator=(const PatternFile &) = delete;
+
+    //Maps a container file, prints the error and returns false if it is not a valid container
+    bool open(const char * file);
+    void close();
+
+    bool isOpen() const { return base != NULL; }
+    int count() const { return header->count; }
+    int width() const { return header->width; }
+    int height() const { return header->height; }
+    int nbits() const { return (int)header->nbits; }
+    int words() const { return (int)header->words; }
+    PatternId patternId(int i) const { return ids[i]; }
+
+    //Bitmap of pattern i
+    const uint64_t * pattern(int i) const;
+
+    //Bitmap of pattern <id>_<interval>, NULL if it is not in the file
+    const uint64_t * find(int id, int interval) const;
+
+    //Tests whether a file starts with the container magic
+    static bool isPatternFile(const char * file);
+};
+
+/*
+Reads a text pattern (0/1 values separated by blanks) into nbits packed bits.
+Returns false if the file can not be read or has less than nbits values.
+*/
+bool readTextPattern(const char * file, int nbits, uint64_t * words);
+
+/*
+Packs the text patterns <path><id>_<interval> for id in [first, last] and
+interval in [6, pat_int] into a container file
+*/
+bool packPatterns(const char * path, int first, int last, int pat_int,
+    int width, int height, const char * file_out);
+
+PatternFile::PatternFile() : base(NULL), length(0), header(NULL), ids(NULL) {
+}
+
+PatternFile::~PatternFile() {
+    close();
+}
+
+bool PatternFile::isPatternFile(const char * file) {
+    char magic[8];
+    FILE * pFile = fopen(file, "rb");
+    if (pFile == NULL)
+        return false;
+    bool ok = fread(magic, 1, 8, pFile) == 8 && memcmp(magic, PATTERN_FILE_MAGIC, 8) == 0;
+    fclose(pFile);
+    return ok;
+}
+
+bool PatternFile::open(const char * file) {
+    close();
+
+    int fd = ::open(file, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PatternFileHeader)) {
+        ::close(fd);
+        return false;
+    }
+
+    length = st.st_size;
+    base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        base = NULL;
+        return false;
+    }
+
+    header = (const PatternFileHeader *)base;
+    const char * error = NULL;
+    if (memcmp(header->magic, PATTERN_FILE_MAGIC, 8) != 0 || header->version != PATTERN_FILE_VERSION)
+        error = "not a version 1 pattern file";
+    else if (header->nbits != (uint64_t)header->width * header->height || header->nbits == 0
+        || header->nbits > (uint64_t)INT32_MAX || header->words != (header->nbits + 63) / 64)
+        error = "inconsistent pattern size";
+    //Id table and bitmaps (every pattern range) inside the mapping, without overflowing
+    else if (header->ids_offset % sizeof(PatternId) != 0 || header->ids_offset > length
+        || header->count > (length - header->ids_offset) / sizeof(PatternId))
+        error = "id table out of the file";
+    else if (header->data_offset % sizeof(uint64_t) != 0 || header->data_offset > length
+        || header->count > (length - header->data_offset) / (header->words * sizeof(uint64_t)))
+        error = "pattern bitmaps out of the file";
+    //The last word of every pattern must be clear past nbits, the kernels count whole words
+    uint64_t pad = error != NULL || header->nbits % 64 == 0 ? 0 : ~0ULL << (header->nbits % 64);
+    for (uint32_t i = 0; pad != 0 && error == NULL && i < header->count; i++)
+        if ((pattern(i)[header->words - 1] & pad) != 0)
+            error = "bits set past the pattern size";
+    if (error != NULL) {
+        fprintf(stderr, "Invalid packed pattern file %s: %s\n", file, error);
+        close();
+        return false;
+    }
+
+    ids = (const PatternId *)((const char *)base + header->ids_offset);
+    for (uint32_t i = 0; i < header->count; i++)
+        index[make_pair((int)ids[i].id, (int)ids[i].interval)] = i;
+
+    return true;
+}
+
+void PatternFile::close() {
+    if (base != NULL)
+        munmap(base, length);
+    base = NULL;
+    length = 0;
+    header = NULL;
+    ids = NULL;
+    index.clear();
+}
+
+const uint64_t * PatternFile::pattern(int i) const {
+    return (const uint64_t *)((const char *)base + header->data_offset) + (size_t)i * header->words;
+}
+
+const uint64_t * PatternFile::find(int id, int interval) const {
+    map< pair<int, int>, int >::const_iterator it = index.find(make_pair(id, interval));
+    if (it == index.end())
+        return NULL;
+    return pattern(it->second);
+}
+
+bool readTextPattern(const char * file, int nbits, uint64_t * words) {
+    FILE * pFile = fopen(file, "rb");
+    if (pFile == NULL)
+        return false;
+
+    int nwords = (nbits + 63) / 64;
+    memset(words, 0, nwords * sizeof(uint64_t));
+
+    //Scans the values as blank separated tokens, a token other than 0 is an active bit
+    char buf[1 << 16];
+    int bit = 0;
+    bool in_token = false;
+    bool nonzero = false;
+    size_t len;
+    while (bit < nbits && (len = fread(buf, 1, sizeof(buf), pFile)) > 0) {
+        for (size_t i = 0; i < len && bit < nbits; i++) {
+            char c = buf[i];
+            if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+                if (in_token) {
+                    if (nonzero)
+                        words[bit >> 6] |= (uint64_t)1 << (bit & 63);
+                    bit++;
+                }
+                in_token = false;
+                nonzero = false;
+            }
+            else {
+                in_token = true;
+                if (c != '0')
+                    nonzero = true;
+            }
+        }
+    }
+    if (in_token && bit < nbits) {
+        if (nonzero)
+            words[bit >> 6] |= (uint64_t)1 << (bit & 63);
+        bit++;
+    }
+    fclose(pFile);
+
+    return bit == nbits;
+}
+
+bool packPatterns(const char * path, int first, int last, int pat_int,
+    int width, int height, const char * file_out) {
+
+    int nbits = width * height;
+    int nwords = (nbits + 63) / 64;
+
+    vector<PatternId> ids;
+    vector<uint64_t> data;
+    vector<uint64_t> words(nwords);
+
+    for (int id = first; id <= last; id++) {
+        for (int interval = 6; interval <= pat_int; interval++) {
+            char file_in[256];
+            snprintf(file_in, sizeof(file_in), "%s%d_%d", path, id, interval);
+            if (readTextPattern(file_in, nbits, &words[0]) == false) {
+                fprintf(stderr, "Can not read %d values from %s\n", nbits, file_in);
+                return false;
+            }
+            PatternId pid;
+            pid.id = id;
+            pid.interval = interval;
+            ids.push_back(pid);
+            data.insert(data.end(), words.begin(), words.end());
+        }
+    }
+
+    PatternFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PATTERN_FILE_MAGIC, 8);
+    h.version = PATTERN_FILE_VERSION;
+    h.width = width;
+    h.height = height;
+    h.count = ids.size();
+    h.nbits = nbits;
+    h.words = nwords;
+    h.ids_offset = sizeof(PatternFileHeader);
+    h.data_offset = (h.ids_offset + ids.size() * sizeof(PatternId) + 63) / 64 * 64;
+
+    FILE * oFile = fopen(file_out, "wb");
+    if (oFile == NULL)
+        return false;
+    fwrite(&h, sizeof(h), 1, oFile);
+    if (ids.size() > 0)
+        fwrite(&ids[0], sizeof(PatternId), ids.size(), oFile);
+    size_t pos = h.ids_offset + ids.size() * sizeof(PatternId);
+    for (; pos < h.data_offset; pos++)
+        fputc(0, oFile);
+    if (data.size() > 0)
+        fwrite(&data[0], sizeof(uint64_t), data.size(), oFile);
+    bool ok = ferror(oFile) == 0;
+    fclose(oFile);
+
+    return ok;
+}
+
+#endif /*PATTERNFILE_H_*/
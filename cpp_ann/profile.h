@@ -0,0 +1,175 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <chrono>
+
+using namespace std;
+
+/*
+Run profile (--profile file): time of every phase of the run, steps to
+convergence of the probes, flips of every time step and peak memory of the
+network structures, written as JSON at the end of the run.
+Modules record into it from their own threads, so every record takes the lock;
+records are per phase or per probe, never per node or per step. Networks
+without a profile (the default) skip the recording with a pointer test.
+*/
+
+enum ProfilePhase {
+    PHASE_CONSTRUCT, //network generation (or mapping of a snapshot module) and its settings
+    PHASE_LEARN, //Hebbian learning and snapshot writing
+    PHASE_LOAD, //loading of the learning and initial state patterns
+    PHASE_RETRIEVE, //initial conditions and network updates of the probes
+    PHASE_OUTPUT, //writing of the results
+    PHASE_COUNT
+};
+
+//Bytes of the network structures
+struct MemoryUse {
+    size_t adjacency; //row offsets, adjacency list or implicit overlay, reverse adjacency
+    size_t weights; //double weights and the packed float or int16 copies
+    size_t states; //states, thresholds, batch queue and per step scratch
+};
+
+class RunProfile {
+private:
+    mutex mtx;
+    chrono::steady_clock::time_point start; //creation of the profile
+    double phase_seconds[PHASE_COUNT]; //summed over the threads doing the phase
+    long phase_calls[PHASE_COUNT];
+    long long probes; //recorded probes
+    long long steps_sum; //sum of their steps
+    vector<long long> steps_hist; //probes with each number of steps
+    vector<long long> flips_sum; //flips of every time step, summed over the probes
+    vector<long long> flips_probes; //probes reaching every time step with flips recorded
+    MemoryUse peak; //largest use of any module
+
+public:
+    RunProfile();
+
+    void addPhase(ProfilePhase phase, double seconds);
+
+    //Probe that ran steps time steps, flips[t] nodes changed in step t (may be empty)
+    void addProbe(int steps, const vector<int> & flips);
+
+    void addMemory(const MemoryUse & use);
+
+    //Writes the profile as JSON, returns false if the file can not be written
+    bool writeJson(const char * file_name, const char * run);
+};
+
+//Adds the time from its construction to its destruction to a phase, nothing without a profile
+class PhaseTimer {
+private:
+    RunProfile * profile;
+    ProfilePhase phase;
+    chrono::steady_clock::time_point t0;
+
+public:
+    PhaseTimer(RunProfile * p, ProfilePhase ph) : profile(p), phase(ph) {
+        if (profile != NULL)
+            t0 = chrono::steady_clock::now();
+    }
+
+    ~PhaseTimer() { stop(); }
+
+    //Ends the phase before the end of the scope
+    void stop() {
+        if (profile != NULL)
+            profile->addPhase(phase, chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+        profile = NULL;
+    }
+};
+
+RunProfile::RunProfile() : probes(0), steps_sum(0) {
+    start = chrono::steady_clock::now();
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        phase_seconds[p] = 0.0;
+        phase_calls[p] = 0;
+    }
+    peak.adjacency = 0;
+    peak.weights = 0;
+    peak.states = 0;
+}
+
+void RunProfile::addPhase(ProfilePhase phase, double seconds) {
+    unique_lock<mutex> lock(mtx);
+    phase_seconds[phase] += seconds;
+    phase_calls[phase]++;
+}
+
+void RunProfile::addProbe(int steps, const vector<int> & flips) {
+    unique_lock<mutex> lock(mtx);
+    probes++;
+    steps_sum += steps;
+    if ((int)steps_hist.size() <= steps)
+        steps_hist.resize(steps + 1, 0);
+    steps_hist[steps]++;
+    if (flips_sum.size() < flips.size()) {
+        flips_sum.resize(flips.size(), 0);
+        flips_probes.resize(flips.size(), 0);
+    }
+    for (size_t t = 0; t < flips.size(); t++) {
+        flips_sum[t] += flips[t];
+        flips_probes[t]++;
+    }
+}
+
+void RunProfile::addMemory(const MemoryUse & use) {
+    unique_lock<mutex> lock(mtx);
+    peak.adjacency = max(peak.adjacency, use.adjacency);
+    peak.weights = max(peak.weights, use.weights);
+    peak.states = max(peak.states, use.states);
+}
+
+bool RunProfile::writeJson(const char * file_name, const char * run) {
+    unique_lock<mutex> lock(mtx);
+    FILE * f = fopen(file_name, "w");
+    if (f == NULL)
+        return false;
+
+    const char * names[PHASE_COUNT] = {"construct", "learn", "load", "retrieve", "output"};
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    fprintf(f, "{\n  \"run\": \"%s\",\n  \"wall_seconds\": %.6f,\n  \"phases\": {\n", run, wall);
+    for (int p = 0; p < PHASE_COUNT; p++)
+        fprintf(f, "    \"%s\": {\"seconds\": %.6f, \"calls\": %ld}%s\n", names[p], phase_seconds[p],
+            phase_calls[p], p + 1 < PHASE_COUNT ? "," : "");
+    fprintf(f, "  },\n");
+
+    int max_steps = (int)steps_hist.size() - 1;
+    fprintf(f, "  \"probes\": %lld,\n  \"mean_steps\": %.6f,\n  \"max_steps\": %d,\n", probes,
+        probes > 0 ? (double)steps_sum / probes : 0.0, max(max_steps, 0));
+
+    //Convergence histogram as [steps, probes] pairs of the steps reached by some probe
+    fprintf(f, "  \"steps_histogram\": [");
+    bool first = true;
+    for (size_t s = 0; s < steps_hist.size(); s++) {
+        if (steps_hist[s] == 0)
+            continue;
+        fprintf(f, "%s[%zu, %lld]", first ? "" : ", ", s, steps_hist[s]);
+        first = false;
+    }
+    fprintf(f, "],\n");
+
+    //Mean flips of time step t over the probes that ran it
+    fprintf(f, "  \"flips_per_step\": {\n    \"probes\": [");
+    for (size_t t = 0; t < flips_probes.size(); t++)
+        fprintf(f, "%s%lld", t > 0 ? ", " : "", flips_probes[t]);
+    fprintf(f, "],\n    \"mean\": [");
+    for (size_t t = 0; t < flips_sum.size(); t++)
+        fprintf(f, "%s%.3f", t > 0 ? ", " : "", (double)flips_sum[t] / flips_probes[t]);
+    fprintf(f, "]\n  },\n");
+
+    fprintf(f, "  \"peak_memory_bytes\": {\"adjacency\": %zu, \"weights\": %zu, \"states\": %zu}\n}\n",
+        peak.adjacency, peak.weights, peak.states);
+
+    bool ok = ferror(f) == 0;
+    fclose(f);
+    return ok;
+}
+
+#endif /*PROFILE_H_*/
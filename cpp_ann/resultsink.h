@@ -0,0 +1,272 @@
+#ifndef RESULTSINK_H_
+#define RESULTSINK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+//Bytes gathered before a buffer is handed to the flush thread
+#define SINK_BUFFER (1 << 20)
+
+//Size of the .npy header (magic to newline), a multiple of 64 with room for the widest row count
+#define NPY_HEADER 256
+
+/*
+Output file kept open for a whole run. Writes go to an in-memory buffer; a full
+buffer is swapped with the one of a background thread, which writes it while the
+caller fills the other, so the caller never waits on the disk unless both are full.
+A file is written by one thread at a time (the callers serialize their writes).
+*/
+class BufferedFile {
+private:
+    FILE * file;
+    string fill; //buffer being filled by the caller
+    string out; //buffer being written by the flush thread
+    bool out_ready; //out holds data not yet written
+    bool stopping;
+    bool failed; //a write failed
+    mutex mtx;
+    condition_variable cv;
+    thread flusher;
+
+    void flushLoop();
+
+    //Hands the fill buffer to the flush thread, waiting for the previous one
+    void handOff();
+
+public:
+    BufferedFile();
+    ~BufferedFile();
+    BufferedFile(const BufferedFile &) = delete;
+    BufferedFile & operator=(const BufferedFile &) = delete;
+
+    //Opens file_name with fopen mode ("w", "wb", "a"...), returns false if it can not be opened
+    bool open(const char * file_name, const char * mode);
+    bool isOpen() const { return file != NULL; }
+
+    void write(const void * data, size_t n);
+    void print(const char * format, ...);
+
+    //Waits until everything written so far is in the file
+    void drain();
+
+    //Overwrites n bytes at offset of the file (i.e. a header), after draining
+    void writeAt(long offset, const void * data, size_t n);
+
+    //Writes the remaining data and closes the file, returns false if any write failed
+    bool close();
+};
+
+/*
+Results of the probes of a run: the text file of the run ("ir, m, t" lines, and
+the cycle period when detecting cycles) and optionally a NumPy .npy file with the
+same rows as a record array of fields ir (int32), m (float64), t (int32) and cycle
+(int32), so numpy.load(file, mmap_mode='r') maps the results without parsing.
+The .npy header is written with room for any row count (NPY_HEADER bytes) and
+completed in place at close.
+*/
+class ResultSink {
+private:
+    BufferedFile text;
+    BufferedFile columns;
+    long rows; //rows of the .npy file
+
+    //.npy header for the current row count, padded to a fixed size
+    string npyHeader() const;
+
+public:
+    ResultSink();
+
+    //Opens the text file and, unless column_file is NULL, the .npy file; returns false on failure
+    bool open(const char * text_file, const char * column_file);
+
+    void write(int ir, double m, int t, int cycle, bool cycles);
+
+    //Completes and closes the files, returns false if any write failed
+    bool close();
+};
+
+//Name of the .npy file of a result file: the extension replaced by .npy
+string columnFileName(const char * file_out);
+
+BufferedFile::BufferedFile() : file(NULL), out_ready(false), stopping(false), failed(false) {
+}
+
+BufferedFile::~BufferedFile() {
+    if (file != NULL)
+        close();
+}
+
+bool BufferedFile::open(const char * file_name, const char * mode) {
+    file = fopen(file_name, mode);
+    if (file == NULL)
+        return false;
+    fill.reserve(SINK_BUFFER);
+    out.reserve(SINK_BUFFER);
+    out_ready = false;
+    stopping = false;
+    failed = false;
+    flusher = thread(&BufferedFile::flushLoop, this);
+    return true;
+}
+
+void BufferedFile::flushLoop() {
+    unique_lock<mutex> lock(mtx);
+    for (;;) {
+        cv.wait(lock, [this]() { return out_ready || stopping; });
+        if (out_ready) {
+            lock.unlock();
+            if (fwrite(out.data(), 1, out.size(), file) != out.size())
+                failed = true;
+            lock.lock();
+            out.clear();
+            out_ready = false;
+            cv.notify_all();
+        }
+        else if (stopping)
+            return;
+    }
+}
+
+void BufferedFile::handOff() {
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [this]() { return !out_ready; });
+    fill.swap(out);
+    out_ready = true;
+    cv.notify_all();
+}
+
+void BufferedFile::write(const void * data, size_t n) {
+    fill.append((const char *)data, n);
+    if (fill.size() >= SINK_BUFFER)
+        handOff();
+}
+
+void BufferedFile::print(const char * format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (n < (int)sizeof(line)) {
+        write(line, n);
+        return;
+    }
+    string longer(n + 1, 0);
+    va_start(args, format);
+    vsnprintf(&longer[0], n + 1, format, args);
+    va_end(args);
+    write(longer.data(), n);
+}
+
+void BufferedFile::drain() {
+    if (fill.empty() == false)
+        handOff();
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [this]() { return !out_ready; });
+}
+
+void BufferedFile::writeAt(long offset, const void * data, size_t n) {
+    drain();
+    long end = ftell(file);
+    fseek(file, offset, SEEK_SET);
+    if (fwrite(data, 1, n, file) != n)
+        failed = true;
+    fseek(file, end, SEEK_SET);
+}
+
+bool BufferedFile::close() {
+    if (file == NULL)
+        return true;
+    drain();
+    {
+        unique_lock<mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    flusher.join();
+    bool ok = failed == false && ferror(file) == 0;
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+    return ok;
+}
+
+ResultSink::ResultSink() : rows(0) {
+}
+
+string ResultSink::npyHeader() const {
+    char dict[NPY_HEADER];
+    snprintf(dict, sizeof(dict), "{'descr': [('ir', '<i4'), ('m', '<f8'), ('t', '<i4'), ('cycle', '<i4')], "
+        "'fortran_order': False, 'shape': (%ld,), }", rows);
+
+    //Magic, version 1.0, header length, then the dictionary padded with spaces to NPY_HEADER bytes
+    string header("\x93NUMPY\x01\x00", 8);
+    uint16_t len = NPY_HEADER - 10;
+    header.append((const char *)&len, 2);
+    header.append(dict);
+    if (header.size() + 1 > NPY_HEADER) {
+        fprintf(stderr, "The .npy header of %ld rows does not fit in %d bytes\n", rows, NPY_HEADER);
+        exit(1);
+    }
+    header.append(NPY_HEADER - 1 - header.size(), ' ');
+    header.push_back('\n');
+    return header;
+}
+
+bool ResultSink::open(const char * text_file, const char * column_file) {
+    rows = 0;
+    if (text.open(text_file, "w") == false)
+        return false;
+    if (column_file != NULL) {
+        if (columns.open(column_file, "wb") == false)
+            return false;
+        string header = npyHeader();
+        columns.write(header.data(), header.size());
+    }
+    return true;
+}
+
+void ResultSink::write(int ir, double m, int t, int cycle, bool cycles) {
+    if (cycles)
+        text.print("%d, %f, %d, %d\n", ir, m, t, cycle);
+    else
+        text.print("%d, %f, %d\n", ir, m, t);
+
+    if (columns.isOpen()) {
+        char record[20]; //Packed little-endian record, as the descr of the header
+        int32_t i32[3] = {ir, t, cycle};
+        memcpy(record, &i32[0], 4);
+        memcpy(record + 4, &m, 8);
+        memcpy(record + 12, &i32[1], 8);
+        columns.write(record, sizeof(record));
+        rows++;
+    }
+}
+
+bool ResultSink::close() {
+    bool ok = text.close();
+    if (columns.isOpen()) {
+        string header = npyHeader();
+        columns.writeAt(0, header.data(), header.size());
+        ok = columns.close() && ok;
+    }
+    return ok;
+}
+
+string columnFileName(const char * file_out) {
+    string name(file_out);
+    size_t dot = name.rfind('.');
+    if (dot != string::npos && name.find('/', dot) == string::npos)
+        name.erase(dot);
+    return name + ".npy";
+}
+
+#endif /*RESULTSINK_H_*/
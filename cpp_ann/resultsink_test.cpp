@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "resultsink.h"
+
+using namespace std;
+
+/*
+Checks of the result sink, run with make test.
+
+A sink closed with ROWS rows (a row count wider than the first header sizes
+allowed) must give a .npy file whose header length is a multiple of 64, whose
+shape is the row count, and whose header was rewritten in place: the records
+start right after it and are the ones written.
+*/
+
+#define ROWS 100000
+
+static int failures = 0;
+
+static void check(bool ok, const char * what) {
+    if (ok == false) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int main() {
+    const char * text_file = "resultsink_test.txt";
+    string column_file = columnFileName(text_file);
+
+    ResultSink sink;
+    check(sink.open(text_file, column_file.c_str()), "open");
+    for (int i = 0; i < ROWS; i++)
+        sink.write(i % 150 + 1, i / (double)ROWS, i % 100, i % 7, true);
+    check(sink.close(), "close");
+
+    FILE * f = fopen(column_file.c_str(), "rb");
+    check(f != NULL, "read the .npy file");
+    if (f == NULL)
+        return 1;
+    vector<char> data;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(f);
+
+    check(data.size() >= 10 && memcmp(data.data(), "\x93NUMPY\x01\x00", 8) == 0, "magic and version");
+    uint16_t len = 0;
+    if (data.size() >= 10)
+        memcpy(&len, data.data() + 8, 2);
+    size_t header = 10 + len;
+    check(header % 64 == 0, "header length is a multiple of 64");
+    check(header <= data.size() && data[header - 1] == '\n', "header ends with a newline");
+    check(data.size() == header + (size_t)ROWS * 20, "file size is the header and the records (header in place)");
+
+    string dict(data.data() + 10, min((size_t)len, data.size() - 10));
+    char shape[64];
+    snprintf(shape, sizeof(shape), "'shape': (%d,)", ROWS);
+    check(dict.find(shape) != string::npos, "shape holds the row count");
+
+    //First and last records follow the header unchanged
+    for (int i = 0; i < ROWS && data.size() == header + (size_t)ROWS * 20; i += ROWS - 1) {
+        const char * rec = data.data() + header + (size_t)i * 20;
+        int32_t ir, t, cycle;
+        double m;
+        memcpy(&ir, rec, 4);
+        memcpy(&m, rec + 4, 8);
+        memcpy(&t, rec + 12, 4);
+        memcpy(&cycle, rec + 16, 4);
+        check(ir == i % 150 + 1 && m == i / (double)ROWS && t == i % 100 && cycle == i % 7, "records");
+    }
+
+    remove(text_file);
+    remove(column_file.c_str());
+
+    if (failures == 0)
+        printf("resultsink_test: all checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
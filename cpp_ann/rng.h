@@ -0,0 +1,57 @@
+#ifndef RNG_H_
+#define RNG_H_
+
+#include <stdint.h>
+
+/*
+Counter-based random streams.
+The value n of a stream is a hash (the SplitMix64 finalizer) of the stream key
+and n, and the key is a hash of the run seed, the module, the stream id (i.e. a
+node or a probe) and the purpose of the stream. Every node or probe draws from
+its own stream, and as any value of a stream can be read directly (unifAt) the
+values a loop gets do not depend on the order or the thread they are read in.
+*/
+
+//Stream purposes, part of the stream id
+enum RandomPurpose {
+    RNG_REWIRING = 1, //rewiring of the adjacency row of a node
+    RNG_NOISE = 2, //noise of the initial condition of a probe
+    RNG_NETWORK = 3 //draws of the network (random patterns and pattern sets)
+};
+
+class RandomStream {
+private:
+    uint64_t key; //hash of the seed and the stream id
+    uint64_t counter; //values drawn
+
+public:
+    RandomStream() : key(0), counter(0) {}
+
+    RandomStream(uint64_t seed, uint64_t module, uint64_t id, int purpose) : counter(0) {
+        key = mix(seed + 0x9E3779B97F4A7C15ULL);
+        key = mix(key ^ (module * 0xD1B54A32D192ED03ULL));
+        key = mix(key ^ (id * 0x9E3779B97F4A7C15ULL + (uint64_t)purpose));
+    }
+
+    //SplitMix64 finalizer
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t next() { return mix(key + (++counter) * 0x9E3779B97F4A7C15ULL); }
+
+    //Uniform number in [0,1), 53 random bits
+    double unif() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    //Value n (from 0) of the stream as a uniform number in [0,1), without drawing it
+    double unifAt(uint64_t n) const {
+        return (mix(key + (n + 1) * 0x9E3779B97F4A7C15ULL) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    //Uniform integer in [0,n), by the high bits of a 32x32 bit product
+    int below(int n) { return (int)(((next() >> 32) * (uint64_t)n) >> 32); }
+};
+
+#endif /*RNG_H_*/
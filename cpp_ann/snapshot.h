@@ -0,0 +1,281 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "network.h"
+#include "patternfile.h"
+
+using namespace std;
+
+/*
+Snapshot of trained networks (the modules of an ensemble).
+
+    header      SnapshotHeader, network parameters shared by the modules
+    modules     for every module, each array starting on a cache line:
+                row offsets (N+1 int32), adjacency (edges int32),
+                weights (edges double), learned patterns (PatternId)
+    table       SnapshotModule of every module, at table_offset
+
+Modules are appended as they finish training and the table is written last.
+The file is memory mapped read only, so the networks of a retrieval run use
+the arrays in place and processes loading the same snapshot share its pages.
+*/
+
+#define SNAPSHOT_MAGIC "ANNSNAP"
+#define SNAPSHOT_VERSION 1
+
+struct SnapshotHeader {
+    char magic[8]; //SNAPSHOT_MAGIC
+    uint32_t version; //SNAPSHOT_VERSION
+    uint32_t modules; //number of modules in the table
+    int32_t neurons; //N
+    int32_t neighbors; //K
+    double rewiring; //w
+    int32_t width; //pattern width
+    int32_t height; //pattern height
+    char topology; //network topology
+    char pad[7];
+    uint64_t table_offset; //byte offset of the module table
+};
+
+struct SnapshotModule {
+    int32_t module; //module number
+    int32_t patterns; //number of learned patterns
+    uint64_t edges; //number of edges
+    uint64_t row_offset; //byte offsets of the arrays
+    uint64_t adj_offset;
+    uint64_t w_offset;
+    uint64_t ids_offset;
+};
+
+//Writes the trained modules of a run, addModule may be called from several threads
+class SnapshotWriter {
+private:
+    FILE * file;
+    SnapshotHeader header;
+    vector<SnapshotModule> table;
+    mutex mtx;
+
+    //Writes n bytes at the next cache line and returns their offset
+    uint64_t writeAligned(const void * data, size_t n);
+
+public:
+    SnapshotWriter();
+    ~SnapshotWriter();
+    SnapshotWriter(const SnapshotWriter &) = delete;
+    SnapshotWriter & operator=(const SnapshotWriter &) = delete;
+
+    bool open(const char * file_name, int neurons, int neighbors, double rewiring,
+        int width, int height, char topology);
+
+    //Appends module ni with its learned patterns
+    void addModule(int ni, Network & Net, const vector<PatternId> & learned);
+
+    //Writes the module table, returns false if any write failed
+    bool close();
+};
+
+//Read-only memory mapped snapshot
+class SnapshotFile {
+private:
+    void * base; //mapping of the whole file
+    size_t length; //mapping size
+    const SnapshotHeader * header;
+    map<int, const SnapshotModule *> index; //module number -> table entry
+
+public:
+    SnapshotFile();
+    ~SnapshotFile();
+    SnapshotFile(const SnapshotFile &) = delete;
+    SnapshotFile & operator=(const SnapshotFile &) = delete;
+
+    //Maps a snapshot file, returns false if it is not a valid snapshot
+    bool open(const char * file_name);
+    void close();
+
+    const SnapshotHeader & parameters() const { return *header; }
+    bool hasModule(int ni) const { return index.count(ni) > 0; }
+
+    //Arrays of module ni, to build its Network in place
+    NetworkArrays module(int ni) const;
+
+    //Patterns learned by module ni
+    vector<PatternId> learned(int ni) const;
+};
+
+SnapshotWriter::SnapshotWriter() : file(NULL) {
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    if (file != NULL)
+        close();
+}
+
+bool SnapshotWriter::open(const char * file_name, int neurons, int neighbors, double rewiring,
+    int width, int height, char topology) {
+    file = fopen(file_name, "wb");
+    if (file == NULL)
+        return false;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.neurons = neurons;
+    header.neighbors = neighbors;
+    header.rewiring = rewiring;
+    header.width = width;
+    header.height = height;
+    header.topology = topology;
+    fwrite(&header, sizeof(header), 1, file);
+    return true;
+}
+
+uint64_t SnapshotWriter::writeAligned(const void * data, size_t n) {
+    long pos = ftell(file);
+    while (pos % CACHE_LINE != 0) {
+        fputc(0, file);
+        pos++;
+    }
+    if (n > 0)
+        fwrite(data, 1, n, file);
+    return pos;
+}
+
+void SnapshotWriter::addModule(int ni, Network & Net, const vector<PatternId> & learned) {
+    NetworkArrays net = Net.arrays();
+    uint64_t edges = net.row_off[net.neurons];
+
+    unique_lock<mutex> lock(mtx);
+    SnapshotModule m;
+    memset(&m, 0, sizeof(m));
+    m.module = ni;
+    m.patterns = learned.size();
+    m.edges = edges;
+    m.row_offset = writeAligned(net.row_off, (net.neurons + 1) * sizeof(int));
+    m.adj_offset = writeAligned(net.adj, edges * sizeof(int));
+    m.w_offset = writeAligned(net.w, edges * sizeof(double));
+    m.ids_offset = writeAligned(learned.data(), learned.size() * sizeof(PatternId));
+    table.push_back(m);
+}
+
+bool SnapshotWriter::close() {
+    header.modules = table.size();
+    header.table_offset = writeAligned(table.data(), table.size() * sizeof(SnapshotModule));
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    file = NULL;
+    return ok;
+}
+
+SnapshotFile::SnapshotFile() : base(NULL), length(0), header(NULL) {
+}
+
+//True if count items of size bytes at offset lie inside a file of length bytes, on a cache line
+static bool snapshotFits(uint64_t offset, uint64_t count, size_t size, size_t length) {
+    return offset % CACHE_LINE == 0 && offset <= length && count <= (length - offset) / size;
+}
+
+SnapshotFile::~SnapshotFile() {
+    close();
+}
+
+bool SnapshotFile::open(const char * file_name) {
+    close();
+
+    int fd = ::open(file_name, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        ::close(fd);
+        return false;
+    }
+
+    length = st.st_size;
+    base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        base = NULL;
+        return false;
+    }
+
+    header = (const SnapshotHeader *)base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 || header->version != SNAPSHOT_VERSION
+        || header->neurons <= 0
+        || snapshotFits(header->table_offset, header->modules, sizeof(SnapshotModule), length) == false) {
+        close();
+        return false;
+    }
+
+    //Every array of every module inside the file, and row offsets that index the adjacency
+    const char * b = (const char *)base;
+    const SnapshotModule * table = (const SnapshotModule *)(b + header->table_offset);
+    int n = header->neurons;
+    for (uint32_t i = 0; i < header->modules; i++) {
+        const SnapshotModule & m = table[i];
+        bool ok = m.patterns >= 0 && m.edges <= (uint64_t)INT32_MAX
+            && snapshotFits(m.row_offset, (uint64_t)n + 1, sizeof(int), length)
+            && snapshotFits(m.adj_offset, m.edges, sizeof(int), length)
+            && snapshotFits(m.w_offset, m.edges, sizeof(double), length)
+            && snapshotFits(m.ids_offset, m.patterns, sizeof(PatternId), length);
+        if (ok) {
+            const int * row_off = (const int *)(b + m.row_offset);
+            const int * adj = (const int *)(b + m.adj_offset);
+            ok = row_off[0] == 0 && (uint64_t)row_off[n] == m.edges;
+            for (int v = 0; ok && v < n; v++)
+                ok = row_off[v] <= row_off[v+1];
+            for (uint64_t e = 0; ok && e < m.edges; e++)
+                ok = adj[e] >= 0 && adj[e] < n;
+        }
+        if (ok == false) {
+            close();
+            return false;
+        }
+        index[m.module] = &m;
+    }
+
+    return true;
+}
+
+void SnapshotFile::close() {
+    if (base != NULL)
+        munmap(base, length);
+    base = NULL;
+    length = 0;
+    header = NULL;
+    index.clear();
+}
+
+NetworkArrays SnapshotFile::module(int ni) const {
+    const SnapshotModule & m = *index.find(ni)->second;
+    const char * b = (const char *)base;
+    NetworkArrays net;
+    net.neurons = header->neurons;
+    net.neighbors = header->neighbors;
+    net.rewiring = header->rewiring;
+    net.row_off = (const int *)(b + m.row_offset);
+    net.adj = (const int *)(b + m.adj_offset);
+    net.w = (const double *)(b + m.w_offset);
+    return net;
+}
+
+vector<PatternId> SnapshotFile::learned(int ni) const {
+    const SnapshotModule & m = *index.find(ni)->second;
+    const PatternId * ids = (const PatternId *)((const char *)base + m.ids_offset);
+    return vector<PatternId>(ids, ids + m.patterns);
+}
+
+#endif /*SNAPSHOT_H_*/
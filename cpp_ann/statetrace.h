@@ -0,0 +1,340 @@
+#ifndef STATETRACE_H_
+#define STATETRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include "bitstate.h"
+#include "resultsink.h"
+
+using namespace std;
+
+/*
+State trace (--trace file): the network state of every time step of every probe
+of updateNet, the state the statistics of the step are computed from.
+
+File layout:
+    header     "SNTRACE1", int32 neurons, width, height, keyframe interval
+    records    one per (probe, step), appended as the probes run
+    index      TraceEntry of every record
+    footer     uint64 index offset, uint64 entries, "SNTRIDX1"
+
+A record is the XOR of the packed state with the one of the previous step of
+the probe, or with the zero state for a keyframe (step 0 and every keyframe
+interval steps), run-length coded over words: pairs of varints (unchanged
+words, changed words) followed by the changed words, until every word of the
+state is covered. Converged steps take a few bytes, and any step is rebuilt
+from its keyframe with at most keyframe interval - 1 deltas.
+All the integers are little-endian. Modules of a run append from their own
+threads, every record takes the lock.
+*/
+
+//Steps between two full states of a probe
+#define TRACE_KEYFRAME 32
+
+//Index entry of a record, a probe is (module, pattern, interval)
+struct TraceEntry {
+    int32_t module;
+    int32_t pattern; //Initial state pattern
+    int32_t interval; //Interval of the initial state pattern
+    int32_t step;
+    uint64_t offset; //Record position in the file
+    uint32_t bytes; //Record size
+    uint32_t key; //1: XOR with the zero state
+};
+
+//Run-length/varint codes the XOR of cur and prev (NULL: zero state) into out
+void encodeStateDelta(const uint64_t * cur, const uint64_t * prev, int words, string & out);
+
+//XORs a record into state, returns false if it is malformed
+bool decodeStateDelta(const uint8_t * rec, size_t bytes, uint64_t * state, int words);
+
+class StateTraceWriter {
+private:
+    BufferedFile file;
+    mutex mtx;
+    uint64_t offset; //Bytes written so far
+    vector<TraceEntry> index;
+
+public:
+    StateTraceWriter();
+
+    //Creates file for states of neurons nodes (width x height), returns false on failure
+    bool open(const char * file_name, int neurons, int width, int height);
+
+    void append(int module, int pattern, int interval, int step, bool key, const string & record);
+
+    //Writes the index and the footer and closes the file, returns false if any write failed
+    bool close();
+};
+
+class StateTraceReader {
+private:
+    FILE * file;
+    int nodes;
+    int width_;
+    int height_;
+    vector<TraceEntry> index; //Sorted by probe and step
+    vector<uint8_t> rec; //Record being decoded
+
+public:
+    StateTraceReader();
+    ~StateTraceReader();
+
+    //Opens a trace file and reads its index, returns false if it is not a complete trace
+    bool open(const char * file_name);
+
+    int neurons() const { return nodes; }
+    int width() const { return width_; }
+    int height() const { return height_; }
+    const vector<TraceEntry> & entries() const { return index; }
+
+    //Last recorded step of a probe (-1: not in the trace)
+    int lastStep(int module, int pattern, int interval) const;
+
+    //Rebuilds the state of a probe at step, returns false if it is not in the trace
+    bool state(int module, int pattern, int interval, int step, BitState & v);
+};
+
+//Prints the probes of a trace file: module, pattern, interval, last step and bytes
+bool listTrace(const char * file_name);
+
+//Writes the state of a traced step as printNetworkState does (0/1 per node, a line per pattern row)
+bool writeTraceState(const char * file_name, int module, int pattern, int interval, int step,
+    const char * out_file);
+
+static void putVarint(string & out, uint64_t x) {
+    while (x >= 0x80) {
+        out.push_back((char)(x | 0x80));
+        x >>= 7;
+    }
+    out.push_back((char)x);
+}
+
+static bool getVarint(const uint8_t * & p, const uint8_t * end, uint64_t & x) {
+    x = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool traceLess(const TraceEntry & a, const TraceEntry & b) {
+    if (a.module != b.module)
+        return a.module < b.module;
+    if (a.pattern != b.pattern)
+        return a.pattern < b.pattern;
+    if (a.interval != b.interval)
+        return a.interval < b.interval;
+    return a.step < b.step;
+}
+
+void encodeStateDelta(const uint64_t * cur, const uint64_t * prev, int words, string & out) {
+    out.clear();
+    int w = 0;
+    while (w < words) {
+        int w0 = w;
+        while (w < words && cur[w] == (prev ? prev[w] : 0))
+            w++;
+        int w1 = w;
+        while (w < words && cur[w] != (prev ? prev[w] : 0))
+            w++;
+        putVarint(out, w1 - w0);
+        putVarint(out, w - w1);
+        for (int i = w1; i < w; i++) {
+            uint64_t x = cur[i] ^ (prev ? prev[i] : 0);
+            out.append((const char *)&x, 8);
+        }
+    }
+}
+
+bool decodeStateDelta(const uint8_t * rec, size_t bytes, uint64_t * state, int words) {
+    const uint8_t * p = rec;
+    const uint8_t * end = rec + bytes;
+    uint64_t w = 0;
+    while (p < end) {
+        uint64_t same, changed;
+        if (getVarint(p, end, same) == false || getVarint(p, end, changed) == false)
+            return false;
+        w += same;
+        if (w + changed > (uint64_t)words || (uint64_t)(end - p) < 8 * changed)
+            return false;
+        for (uint64_t i = 0; i < changed; i++, w++, p += 8) {
+            uint64_t x;
+            memcpy(&x, p, 8);
+            state[w] ^= x;
+        }
+    }
+    return w == (uint64_t)words;
+}
+
+StateTraceWriter::StateTraceWriter() : offset(0) {
+}
+
+bool StateTraceWriter::open(const char * file_name, int neurons, int width, int height) {
+    if (file.open(file_name, "wb") == false)
+        return false;
+    int32_t h[4] = {neurons, width, height, TRACE_KEYFRAME};
+    file.write("SNTRACE1", 8);
+    file.write(h, sizeof(h));
+    offset = 8 + sizeof(h);
+    index.clear();
+    return true;
+}
+
+void StateTraceWriter::append(int module, int pattern, int interval, int step, bool key,
+    const string & record) {
+    TraceEntry e;
+    e.module = module;
+    e.pattern = pattern;
+    e.interval = interval;
+    e.step = step;
+    e.bytes = (uint32_t)record.size();
+    e.key = key;
+
+    unique_lock<mutex> lock(mtx);
+    e.offset = offset;
+    file.write(record.data(), record.size());
+    offset += record.size();
+    index.push_back(e);
+}
+
+bool StateTraceWriter::close() {
+    if (file.isOpen() == false)
+        return true;
+    uint64_t footer[2] = {offset, (uint64_t)index.size()};
+    file.write(index.data(), index.size() * sizeof(TraceEntry));
+    file.write(footer, sizeof(footer));
+    file.write("SNTRIDX1", 8);
+    return file.close();
+}
+
+StateTraceReader::StateTraceReader() : file(NULL), nodes(0), width_(0), height_(0) {
+}
+
+StateTraceReader::~StateTraceReader() {
+    if (file != NULL)
+        fclose(file);
+}
+
+bool StateTraceReader::open(const char * file_name) {
+    file = fopen(file_name, "rb");
+    if (file == NULL)
+        return false;
+
+    char magic[8];
+    int32_t h[4];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, "SNTRACE1", 8) != 0
+        || fread(h, sizeof(h), 1, file) != 1 || h[0] <= 0)
+        return false;
+    nodes = h[0];
+    width_ = h[1];
+    height_ = h[2];
+
+    uint64_t footer[2];
+    if (fseek(file, -(long)(sizeof(footer) + 8), SEEK_END) != 0 || fread(footer, sizeof(footer), 1, file) != 1
+        || fread(magic, 1, 8, file) != 8 || memcmp(magic, "SNTRIDX1", 8) != 0)
+        return false;
+    index.resize(footer[1]);
+    if (fseek(file, (long)footer[0], SEEK_SET) != 0
+        || fread(index.data(), sizeof(TraceEntry), index.size(), file) != index.size())
+        return false;
+    stable_sort(index.begin(), index.end(), traceLess);
+    return true;
+}
+
+int StateTraceReader::lastStep(int module, int pattern, int interval) const {
+    TraceEntry e = {module, pattern, interval + 1, 0, 0, 0, 0};
+    vector<TraceEntry>::const_iterator it = lower_bound(index.begin(), index.end(), e, traceLess);
+    if (it == index.begin())
+        return -1;
+    --it;
+    if (it->module != module || it->pattern != pattern || it->interval != interval)
+        return -1;
+    return it->step;
+}
+
+bool StateTraceReader::state(int module, int pattern, int interval, int step, BitState & v) {
+    TraceEntry e = {module, pattern, interval, step, 0, 0, 0};
+    vector<TraceEntry>::const_iterator it = lower_bound(index.begin(), index.end(), e, traceLess);
+    if (it == index.end() || traceLess(e, *it))
+        return false;
+
+    //Back to the keyframe of the step, then forward over the deltas
+    vector<TraceEntry>::const_iterator k = it;
+    while (k->key == 0) {
+        if (k == index.begin() || (k - 1)->module != module || (k - 1)->pattern != pattern
+            || (k - 1)->interval != interval)
+            return false;
+        --k;
+    }
+
+    v.assign(nodes, 0);
+    for (; k <= it; ++k) {
+        rec.resize(k->bytes);
+        if (fseek(file, (long)k->offset, SEEK_SET) != 0 || fread(rec.data(), 1, rec.size(), file) != rec.size()
+            || decodeStateDelta(rec.data(), rec.size(), v.data(), v.nwords()) == false)
+            return false;
+    }
+    return true;
+}
+
+bool listTrace(const char * file_name) {
+    StateTraceReader reader;
+    if (reader.open(file_name) == false) {
+        fprintf(stderr, "Invalid trace file %s\n", file_name);
+        return false;
+    }
+    const vector<TraceEntry> & e = reader.entries();
+    printf("N=%d (%dx%d), %zu steps\n", reader.neurons(), reader.width(), reader.height(), e.size());
+    puts("module, pattern, interval, last step, bytes");
+    for (size_t i = 0; i < e.size(); ) {
+        size_t j = i;
+        uint64_t bytes = 0;
+        for (; j < e.size() && e[j].module == e[i].module && e[j].pattern == e[i].pattern
+            && e[j].interval == e[i].interval; j++)
+            bytes += e[j].bytes;
+        printf("%d, %d, %d, %d, %llu\n", e[i].module, e[i].pattern, e[i].interval, e[j-1].step,
+            (unsigned long long)bytes);
+        i = j;
+    }
+    return true;
+}
+
+bool writeTraceState(const char * file_name, int module, int pattern, int interval, int step,
+    const char * out_file) {
+    StateTraceReader reader;
+    if (reader.open(file_name) == false) {
+        fprintf(stderr, "Invalid trace file %s\n", file_name);
+        return false;
+    }
+    BitState v;
+    if (reader.state(module, pattern, interval, step, v) == false) {
+        fprintf(stderr, "Step %d of module %d pattern %d_%d is not in %s\n", step, module, pattern,
+            interval, file_name);
+        return false;
+    }
+
+    FILE * vsFile = fopen(out_file, "w");
+    if (vsFile == NULL) {
+        fprintf(stderr, "Can not write %s\n", out_file);
+        return false;
+    }
+    int width = reader.width() > 0 ? reader.width() : reader.neurons();
+    for (int i = 0; i < reader.neurons(); i++) {
+        fprintf(vsFile, "%d ", (int)v.get(i));
+        if ((i+1) % width == 0)
+            fprintf(vsFile, "\n");
+    }
+    fclose(vsFile);
+    return true;
+}
+
+#endif /*STATETRACE_H_*/
@@ -0,0 +1,829 @@
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <deque>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "ensemble.h"
+#include "threadpool.h"
+#include "patternbank.h"
+
+using namespace std;
+
+/*
+Parameter sweep: runs every combination of a grid file in a single process.
+
+The grid file lists the values of each parameter of the command line, one
+parameter per line, with the names of the usage text (SNS and NN can be used
+for subsetSize and nNets):
+
+    # comment
+    NN = 10 15                     list of values
+    SNS = 1:15                     integer range a:b or a:b:step
+    K = {240/NN}                   expression of other parameters: + - * / // % ( )
+    P = {SNS*NN}
+    require P <= 150               skips the combinations where the condition is false
+    require top != 'x'             letter values (T, top) compare with quoted letters
+
+Combinations are expanded with the first parameter as the outermost loop.
+Every job writes the file returnFileName gives for its parameters; jobs run
+on a work-stealing TaskPool and the patterns of all the jobs are loaded once
+into banks shared by them.
+
+With --workers n the sweep process is a coordinator of n forked worker
+processes instead. The banks are loaded before the fork into shared memory
+(text patterns into one shared anonymous segment, packed files are mapped), and
+a shared result table gets a slot of rows per job. Each worker is connected by
+a socket pair: it reads the index of a job, runs it writing its rows into the
+slot of the job and answers (job, rows). The coordinator writes the result file
+of the job from the table, so files are only written for complete jobs. A worker
+that dies (crash, signal, out of memory) closes its socket; its job is queued
+again, up to SWEEP_RETRIES more times, and a new worker is forked to take it
+while the rest of the sweep goes on.
+*/
+
+//Times a job is run again after its worker died
+#define SWEEP_RETRIES 2
+
+//Parameter names in command line order (argv[1..21])
+static const char * const SWEEP_NAMES[21] = {"N", "K", "w", "a", "B", "T", "t", "rho", "np", "time",
+    "p", "P", "pi", "x", "wth", "ht", "path1", "path2", "top", "subsetSize", "nNets"};
+
+//One parameter of the grid file
+struct SweepParam {
+    int arg; //argv index of the parameter
+    vector<string> values; //values, an expression is kept between braces
+};
+
+//One job of the sweep
+struct SweepJob {
+    vector<string> args; //argv[0..21] of the job
+    double cost; //estimated work, for the scheduling and the ETA
+};
+
+//Row of the shared result table of a sweep with worker processes
+struct SweepRow {
+    int32_t ir;
+    int32_t t;
+    int32_t cycle;
+    int32_t pad;
+    double m;
+};
+
+//Worker process of a sweep
+struct SweepWorker {
+    pid_t pid; //-1: not running
+    int fd; //coordinator end of the socket pair
+    int job; //job being run (-1: idle)
+};
+
+//Evaluates arithmetic and comparison expressions over the parameter values
+class SweepExpr {
+private:
+    const char * s; //next character
+    const map<string, double> & vars;
+    bool ok;
+
+    void skip() { while (isspace(*s)) s++; }
+    double comparison();
+    double sum();
+    double term();
+    double factor();
+
+public:
+    SweepExpr(const char * text, const map<string, double> & vars) : s(text), vars(vars), ok(true) {}
+
+    //Value of the whole text, ok is false if it can not be evaluated
+    double eval(bool & ok);
+};
+
+//Returns the argv index of a parameter name, 0 if unknown
+int sweepParamIndex(const string & name);
+
+//Reads a grid file and expands it into jobs, prints the errors and returns false on any
+bool readSweepFile(const char * file_name, vector<SweepJob> & jobs);
+
+//Runs the jobs of a grid file with the given options, returns false on errors
+bool runSweep(const char * file_name, const SimParams & options);
+
+//Runs the jobs of a sweep on options.workers forked processes, in the given order
+bool runSweepWorkers(const char * file_name, const SimParams & options, const vector<SimParams> & job_sp,
+    const vector<string> & job_out, const vector<double> & job_cost, const vector<PatternBank *> & job_learn,
+    const vector<PatternBank *> & job_init, const vector<int> & order);
+
+//Formats seconds as h:mm:ss
+string sweepClock(double seconds);
+
+double SweepExpr::eval(bool & result_ok) {
+    double v = comparison();
+    skip();
+    result_ok = ok && *s == 0;
+    return v;
+}
+
+double SweepExpr::comparison() {
+    double a = sum();
+    skip();
+    if ((s[0] == '<' || s[0] == '>' || s[0] == '=' || s[0] == '!') && s[1] == '=') {
+        char op = s[0];
+        s += 2;
+        double b = sum();
+        switch (op) {
+            case '<': return a <= b;
+            case '>': return a >= b;
+            case '=': return a == b;
+            default: return a != b;
+        }
+    }
+    if (s[0] == '<' || s[0] == '>') {
+        char op = *s++;
+        double b = sum();
+        return op == '<' ? a < b : a > b;
+    }
+    return a;
+}
+
+double SweepExpr::sum() {
+    double a = term();
+    for (;;) {
+        skip();
+        if (*s == '+') { s++; a += term(); }
+        else if (*s == '-') { s++; a -= term(); }
+        else return a;
+    }
+}
+
+double SweepExpr::term() {
+    double a = factor();
+    for (;;) {
+        skip();
+        if (s[0] == '/' && s[1] == '/') { s += 2; a = floor(a / factor()); }
+        else if (*s == '*') { s++; a *= factor(); }
+        else if (*s == '/') { s++; a /= factor(); }
+        else if (*s == '%') { s++; a = fmod(a, factor()); }
+        else return a;
+    }
+}
+
+double SweepExpr::factor() {
+    skip();
+    if (*s == '(') {
+        s++;
+        double a = comparison();
+        skip();
+        if (*s == ')')
+            s++;
+        else
+            ok = false;
+        return a;
+    }
+    if (*s == '-') {
+        s++;
+        return -factor();
+    }
+    if (s[0] == '\'' && s[1] != 0 && s[2] == '\'') {
+        double a = (unsigned char)s[1];
+        s += 3;
+        return a;
+    }
+    if (isdigit(*s) || *s == '.') {
+        char * end;
+        double a = strtod(s, &end);
+        s = end;
+        return a;
+    }
+    if (isalpha(*s) || *s == '_') {
+        string name;
+        while (isalnum(*s) || *s == '_')
+            name += *s++;
+        map<string, double>::const_iterator it = vars.find(name);
+        if (it == vars.end()) {
+            ok = false;
+            return 0;
+        }
+        return it->second;
+    }
+    ok = false;
+    return 0;
+}
+
+int sweepParamIndex(const string & name) {
+    if (name == "SNS")
+        return 20;
+    if (name == "NN")
+        return 21;
+    for (int i = 0; i < 21; i++)
+        if (name == SWEEP_NAMES[i])
+            return i + 1;
+    return 0;
+}
+
+//Formats an expression result, integers without decimals as the command line takes them
+static string sweepNumber(double v) {
+    char buf[64];
+    if (fabs(v - llround(v)) < 1e-9)
+        snprintf(buf, sizeof(buf), "%lld", llround(v));
+    else
+        snprintf(buf, sizeof(buf), "%g", v);
+    return buf;
+}
+
+//Value of a parameter in expressions, a letter is its character code
+static double sweepValue(const string & value) {
+    char * end;
+    double v = strtod(value.c_str(), &end);
+    if (*end != 0 && value.size() == 1)
+        return (unsigned char)value[0];
+    return v;
+}
+
+//Expands the combinations of params from parameter i, filling args
+static bool expandSweep(const vector<SweepParam> & params, const vector<string> & requires, size_t i,
+    vector<string> & args, vector<SweepJob> & jobs) {
+
+    if (i < params.size()) {
+        for (size_t v = 0; v < params[i].values.size(); v++) {
+            args[params[i].arg] = params[i].values[v];
+            if (expandSweep(params, requires, i + 1, args, jobs) == false)
+                return false;
+        }
+        return true;
+    }
+
+    //Evaluates the expressions once the parameters they use are known
+    SweepJob job;
+    job.args = args;
+    map<string, double> vars;
+    vector<bool> known(22, false);
+    for (int a = 1; a <= 21; a++) {
+        if (job.args[a].empty() || job.args[a][0] != '{') {
+            vars[SWEEP_NAMES[a-1]] = sweepValue(job.args[a]);
+            known[a] = true;
+        }
+    }
+    vars["SNS"] = vars["subsetSize"];
+    vars["NN"] = vars["nNets"];
+
+    for (int pass = 0; pass < 21; pass++) {
+        for (int a = 1; a <= 21; a++) {
+            if (known[a])
+                continue;
+            string text = job.args[a].substr(1, job.args[a].size() - 2);
+            bool ok;
+            double v = SweepExpr(text.c_str(), vars).eval(ok);
+            if (ok) {
+                job.args[a] = sweepNumber(v);
+                vars[SWEEP_NAMES[a-1]] = v;
+                if (a == 20) vars["SNS"] = v;
+                if (a == 21) vars["NN"] = v;
+                known[a] = true;
+            }
+        }
+    }
+    for (int a = 1; a <= 21; a++) {
+        if (known[a] == false) {
+            fprintf(stderr, "Can not evaluate %s = %s\n", SWEEP_NAMES[a-1], job.args[a].c_str());
+            return false;
+        }
+    }
+
+    for (size_t r = 0; r < requires.size(); r++) {
+        bool ok;
+        double v = SweepExpr(requires[r].c_str(), vars).eval(ok);
+        if (ok == false) {
+            fprintf(stderr, "Can not evaluate require %s\n", requires[r].c_str());
+            return false;
+        }
+        if (v == 0)
+            return true;
+    }
+
+    //Learning and retrieval visit N*K edges per pattern of every module
+    job.cost = vars["nNets"] * (vars["subsetSize"] + vars["P"]) * (vars["pi"] - 5)
+        * vars["N"] * vars["K"] + 1;
+    jobs.push_back(job);
+    return true;
+}
+
+bool readSweepFile(const char * file_name, vector<SweepJob> & jobs) {
+    FILE * gFile = fopen(file_name, "r");
+    if (gFile == NULL) {
+        fprintf(stderr, "Can not open grid file %s\n", file_name);
+        return false;
+    }
+
+    vector<SweepParam> params;
+    vector<string> requires;
+    vector<bool> given(22, false);
+    char line[4096];
+    int nline = 0;
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof(line), gFile) != NULL) {
+        nline++;
+        char * hash = strchr(line, '#');
+        if (hash != NULL)
+            *hash = 0;
+
+        char * p = line;
+        while (isspace(*p))
+            p++;
+        if (*p == 0)
+            continue;
+
+        if (strncmp(p, "require", 7) == 0 && isspace(p[7])) {
+            requires.push_back(p + 7);
+            continue;
+        }
+
+        char * eq = strchr(p, '=');
+        if (eq == NULL) {
+            fprintf(stderr, "%s:%d: expected name = values\n", file_name, nline);
+            ok = false;
+            break;
+        }
+
+        string name(p, eq - p);
+        name.erase(name.find_last_not_of(" \t") + 1);
+        SweepParam param;
+        param.arg = sweepParamIndex(name);
+        if (param.arg == 0 || given[param.arg]) {
+            fprintf(stderr, "%s:%d: unknown or repeated parameter %s\n", file_name, nline, name.c_str());
+            ok = false;
+            break;
+        }
+        given[param.arg] = true;
+
+        //Values: blank or comma separated words, {expressions} and a:b[:step] ranges
+        char * v = eq + 1;
+        while (ok) {
+            while (isspace(*v) || *v == ',')
+                v++;
+            if (*v == 0)
+                break;
+            string word;
+            if (*v == '{') {
+                char * close = strchr(v, '}');
+                if (close == NULL) {
+                    fprintf(stderr, "%s:%d: missing }\n", file_name, nline);
+                    ok = false;
+                    break;
+                }
+                word.assign(v, close + 1 - v);
+                v = close + 1;
+            }
+            else {
+                while (*v != 0 && isspace(*v) == false && *v != ',')
+                    word += *v++;
+            }
+
+            int a, b, step = 1;
+            int nf = sscanf(word.c_str(), "%d:%d:%d", &a, &b, &step);
+            if (word[0] != '{' && strchr(word.c_str(), ':') != NULL && nf >= 2 && step > 0) {
+                for (int x = a; x <= b; x += step)
+                    param.values.push_back(sweepNumber(x));
+            }
+            else {
+                param.values.push_back(word);
+            }
+        }
+
+        if (ok && param.values.empty()) {
+            fprintf(stderr, "%s:%d: no values for %s\n", file_name, nline, name.c_str());
+            ok = false;
+        }
+        params.push_back(param);
+    }
+    fclose(gFile);
+
+    for (int a = 1; ok && a <= 21; a++) {
+        if (given[a] == false) {
+            fprintf(stderr, "%s: missing parameter %s\n", file_name, SWEEP_NAMES[a-1]);
+            ok = false;
+        }
+    }
+
+    vector<string> args(22);
+    args[0] = "sparsenet";
+    return ok && expandSweep(params, requires, 0, args, jobs);
+}
+
+string sweepClock(double seconds) {
+    long t = (long)(seconds + 0.5);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%ld:%02ld:%02ld", t / 3600, (t / 60) % 60, t % 60);
+    return buf;
+}
+
+//Prints the jobs done and the remaining time from the estimated work done
+static void sweepProgress(int done, int njobs, double done_cost, double total_cost,
+    chrono::steady_clock::time_point t0) {
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    double eta = elapsed * (total_cost - done_cost) / done_cost;
+    printf("\r%d/%d jobs %3.0f%%, elapsed %s, ETA %s ", done, njobs,
+        100.0 * done_cost / total_cost, sweepClock(elapsed).c_str(), sweepClock(eta).c_str());
+    fflush(stdout);
+}
+
+bool runSweep(const char * file_name, const SimParams & options) {
+    if (options.save_snapshot[0] != 0 || options.load_snapshot[0] != 0) {
+        fprintf(stderr, "Snapshots are not supported in sweep mode\n");
+        return false;
+    }
+    if (options.trace[0] != 0) {
+        fprintf(stderr, "State traces are not supported in sweep mode\n");
+        return false;
+    }
+
+    vector<SweepJob> jobs;
+    if (readSweepFile(file_name, jobs) == false)
+        return false;
+
+    //Parameters and result file of every job, repeated configurations run once
+    vector<SimParams> job_sp;
+    vector<string> job_out;
+    vector<double> job_cost;
+    set<string> outputs;
+    for (size_t j = 0; j < jobs.size(); j++) {
+        vector<char *> argv(22);
+        for (int a = 0; a < 22; a++)
+            argv[a] = &jobs[j].args[a][0];
+        string file_out = returnFileName(&argv[0]);
+        if (outputs.insert(file_out).second == false)
+            continue;
+        SimParams sp = options;
+        readParameters(&argv[0], sp);
+        job_sp.push_back(sp);
+        job_out.push_back(file_out);
+        job_cost.push_back(jobs[j].cost);
+    }
+    int njobs = job_sp.size();
+    if (njobs == 0) {
+        fprintf(stderr, "%s gives no jobs\n", file_name);
+        return false;
+    }
+
+    int threads = options.threads < 1 ? ThreadPool::hardwareThreads() : options.threads;
+
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+
+    //One bank per pattern source, shared by all the jobs reading it
+    map<string, unique_ptr<PatternBank> > banks;
+    vector<PatternBank *> job_learn(njobs), job_init(njobs);
+    for (int j = 0; j < njobs; j++) {
+        const char * paths[2] = {job_sp[j].path1, job_sp[j].path2};
+        PatternBank ** bank[2] = {&job_learn[j], &job_init[j]};
+        for (int b = 0; b < 2; b++) {
+            char key[300];
+            snprintf(key, sizeof(key), "%s|%d", paths[b], job_sp[j].Neurons);
+            unique_ptr<PatternBank> & slot = banks[key];
+            if (!slot)
+                slot.reset(new PatternBank(paths[b], job_sp[j].Neurons));
+            *bank[b] = slot.get();
+        }
+        requestPatterns(job_sp[j], *job_learn[j], *job_init[j]);
+    }
+    for (map<string, unique_ptr<PatternBank> >::iterator it = banks.begin(); it != banks.end(); ++it) {
+        it->second->setShared(options.workers > 0);
+        it->second->load(threads);
+        if (options.verbose)
+            it->second->report("Patterns");
+    }
+
+    //Longest jobs first, so the last ones to finish are short
+    vector<int> order(njobs);
+    for (int j = 0; j < njobs; j++)
+        order[j] = j;
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return job_cost[a] > job_cost[b]; });
+
+    if (options.workers > 0)
+        return runSweepWorkers(file_name, options, job_sp, job_out, job_cost, job_learn, job_init, order);
+
+    int workers = min(threads, njobs);
+    int job_threads = max(1, threads / workers);
+    double total_cost = 0.0;
+    for (int j = 0; j < njobs; j++)
+        total_cost += job_cost[j];
+
+    printf("Sweep %s: %d jobs on %d threads, seed %llu\n", file_name, njobs, threads, options.seed);
+    fflush(stdout);
+
+    int done = 0;
+    double done_cost = 0.0;
+    mutex progress_mtx;
+
+    TaskPool pool(workers);
+    for (int i = 0; i < njobs; i++) {
+        int j = order[i];
+        pool.submit([&, j]() {
+            SimParams sp = job_sp[j];
+            sp.threads = job_threads;
+
+            SharedInputs in;
+            in.learn = job_learn[j];
+            in.init = job_init[j];
+            in.snapshot = NULL;
+            in.save = NULL;
+            in.profile = NULL;
+            in.trace = NULL;
+            runEnsemble(sp, job_out[j].c_str(), in);
+
+            unique_lock<mutex> lock(progress_mtx);
+            done++;
+            done_cost += job_cost[j];
+            sweepProgress(done, njobs, done_cost, total_cost, t0);
+        });
+    }
+    pool.wait();
+
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    printf("\nSweep done in %s\n", sweepClock(elapsed).c_str());
+
+    return true;
+}
+
+//Reads or writes n bytes of a socket, false on end of file or error
+static bool sweepRead(int fd, void * data, size_t n) {
+    char * p = (char *)data;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool sweepWrite(int fd, const void * data, size_t n) {
+    const char * p = (const char *)data;
+    while (n > 0) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL); //A dead peer is an error, not SIGPIPE
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+//Result rows of a job: every module tests every initial state pattern
+static long sweepRows(const SimParams & sp) {
+    return (long)sp.nNets * sp.patterns * max(0, sp.pat_int - 5);
+}
+
+//Writes the result file (and .npy file) of a job from its rows of the result table
+static bool writeSweepResults(const SimParams & sp, const char * file_out, const SweepRow * rows, int n) {
+    ResultSink sink;
+    string column_file = columnFileName(file_out);
+    if (sink.open(file_out, sp.npy ? column_file.c_str() : NULL) == false) {
+        fprintf(stderr, "Can not write results file %s\n", sp.npy ? column_file.c_str() : file_out);
+        return false;
+    }
+    for (int i = 0; i < n; i++)
+        sink.write(rows[i].ir, rows[i].m, rows[i].t, rows[i].cycle, sp.cycles > 0);
+    if (sink.close() == false) {
+        fprintf(stderr, "Can not write results file %s\n", file_out);
+        return false;
+    }
+    return true;
+}
+
+bool runSweepWorkers(const char * file_name, const SimParams & options, const vector<SimParams> & job_sp,
+    const vector<string> & job_out, const vector<double> & job_cost, const vector<PatternBank *> & job_learn,
+    const vector<PatternBank *> & job_init, const vector<int> & order) {
+
+    int njobs = job_sp.size();
+    int threads = options.threads < 1 ? ThreadPool::hardwareThreads() : options.threads;
+    int nworkers = min(options.workers, njobs);
+    int job_threads = max(1, threads / nworkers);
+
+    //Shared result table, a slot of rows per job
+    vector<long> first(njobs + 1, 0);
+    for (int j = 0; j < njobs; j++)
+        first[j+1] = first[j] + sweepRows(job_sp[j]);
+    size_t table_bytes = max((size_t)first[njobs] * sizeof(SweepRow), (size_t)1);
+    void * mapped = mmap(NULL, table_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "Can not map %zu bytes of shared memory for the result table\n", table_bytes);
+        return false;
+    }
+    SweepRow * table = (SweepRow *)mapped;
+
+    double total_cost = 0.0;
+    for (int j = 0; j < njobs; j++)
+        total_cost += job_cost[j];
+
+    printf("Sweep %s: %d jobs on %d worker processes of %d threads, seed %llu\n", file_name, njobs, nworkers,
+        job_threads, options.seed);
+    fflush(stdout);
+
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    vector<SweepWorker> workers(nworkers);
+    for (int w = 0; w < nworkers; w++) {
+        workers[w].pid = -1;
+        workers[w].fd = -1;
+        workers[w].job = -1;
+    }
+
+    //Forks worker w, which runs the jobs it reads from its socket until the coordinator closes it
+    auto spawn = [&](int w) -> bool {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+            return false;
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(sv[0]);
+            close(sv[1]);
+            return false;
+        }
+        if (pid == 0) {
+            close(sv[0]);
+            for (int k = 0; k < nworkers; k++)
+                if (workers[k].fd >= 0)
+                    close(workers[k].fd);
+
+            int32_t j;
+            while (sweepRead(sv[1], &j, sizeof(j))) {
+                SimParams sp = job_sp[j];
+                sp.threads = job_threads;
+
+                SharedInputs in;
+                in.learn = job_learn[j];
+                in.init = job_init[j];
+                in.snapshot = NULL;
+                in.save = NULL;
+                in.profile = NULL;
+                in.trace = NULL;
+
+                SweepRow * rows = table + first[j];
+                long capacity = first[j+1] - first[j];
+                int32_t n = 0;
+                runEnsembleModules(sp, job_out[j].c_str(), in, [&](const vector<ProbeResult> & res) {
+                    if (n + (long)res.size() > capacity) {
+                        fprintf(stderr, "Job %s gives more than %ld results\n", job_out[j].c_str(), capacity);
+                        _exit(1);
+                    }
+                    for (size_t i = 0; i < res.size(); i++, n++) {
+                        rows[n].ir = res[i].ir;
+                        rows[n].t = res[i].t;
+                        rows[n].cycle = res[i].cycle;
+                        rows[n].pad = 0;
+                        rows[n].m = res[i].m;
+                    }
+                });
+
+                fflush(stdout);
+                int32_t reply[2] = {j, n};
+                if (sweepWrite(sv[1], reply, sizeof(reply)) == false)
+                    break;
+            }
+            fflush(stdout);
+            _exit(0);
+        }
+        close(sv[1]);
+        workers[w].pid = pid;
+        workers[w].fd = sv[0];
+        workers[w].job = -1;
+        return true;
+    };
+
+    //Closes the socket of worker w and waits for it, returns its wait status
+    auto reap = [&](int w) -> int {
+        int status = 0;
+        close(workers[w].fd);
+        while (waitpid(workers[w].pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        workers[w].pid = -1;
+        workers[w].fd = -1;
+        return status;
+    };
+
+    deque<int> pending(order.begin(), order.end());
+    vector<int> attempts(njobs, 0);
+    int done = 0;
+    int failed = 0;
+    double done_cost = 0.0;
+    bool ok = true; //every job wrote its results
+    bool stop = false; //workers can not be started
+
+    while (done + failed < njobs && stop == false) {
+        //Idle workers take the next jobs, workers that died are replaced while jobs are pending
+        for (int w = 0; w < nworkers && pending.empty() == false; w++) {
+            if (workers[w].job >= 0)
+                continue;
+            if (workers[w].pid < 0 && spawn(w) == false) {
+                fprintf(stderr, "\nCan not start a worker process\n");
+                stop = true;
+                break;
+            }
+            int32_t j = pending.front();
+            if (sweepWrite(workers[w].fd, &j, sizeof(j)) == false) {
+                reap(w); //Forked again on the next pass, the job stays pending
+                continue;
+            }
+            pending.pop_front();
+            workers[w].job = j;
+        }
+        if (stop)
+            break;
+
+        vector<pollfd> fds;
+        vector<int> busy;
+        for (int w = 0; w < nworkers; w++) {
+            if (workers[w].job < 0)
+                continue;
+            pollfd p = {workers[w].fd, POLLIN, 0};
+            fds.push_back(p);
+            busy.push_back(w);
+        }
+        if (fds.empty())
+            continue;
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            stop = true;
+            break;
+        }
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i].revents == 0)
+                continue;
+            int w = busy[i];
+            int j = workers[w].job;
+            workers[w].job = -1;
+
+            int32_t reply[2];
+            if (sweepRead(workers[w].fd, reply, sizeof(reply)) && reply[0] == j) {
+                if (writeSweepResults(job_sp[j], job_out[j].c_str(), table + first[j], reply[1]) == false)
+                    ok = false;
+                done++;
+                done_cost += job_cost[j];
+                sweepProgress(done, njobs, done_cost, total_cost, t0);
+                continue;
+            }
+
+            //The worker died in the job: a new one runs it again, the other jobs go on
+            int status = reap(w);
+            attempts[j]++;
+            char cause[64];
+            if (WIFSIGNALED(status))
+                snprintf(cause, sizeof(cause), "killed by signal %d", WTERMSIG(status));
+            else
+                snprintf(cause, sizeof(cause), "exit status %d", WEXITSTATUS(status));
+            if (attempts[j] <= SWEEP_RETRIES) {
+                fprintf(stderr, "\nWorker of job %s died (%s), retrying (%d/%d)\n", job_out[j].c_str(), cause,
+                    attempts[j], SWEEP_RETRIES);
+                pending.push_front(j);
+            }
+            else {
+                fprintf(stderr, "\nWorker of job %s died (%s), job failed after %d attempts\n",
+                    job_out[j].c_str(), cause, attempts[j]);
+                failed++;
+                ok = false;
+            }
+        }
+    }
+
+    //Closed sockets end the workers
+    for (int w = 0; w < nworkers; w++) {
+        if (workers[w].pid < 0)
+            continue;
+        if (workers[w].job >= 0)
+            kill(workers[w].pid, SIGTERM);
+        reap(w);
+    }
+    munmap(table, table_bytes);
+
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    printf("\nSweep done in %s, %d of %d jobs%s\n", sweepClock(elapsed).c_str(), done, njobs,
+        failed > 0 ? " (failed jobs have no result file)" : "");
+
+    return ok && stop == false;
+}
+
+#endif /*SWEEP_H_*/
@@ -0,0 +1,258 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <memory>
+
+using namespace std;
+
+/*
+Fork-join pool of persistent threads.
+parallelFor(n, fn) calls fn(c) for every chunk c in [0, n) and returns when all
+of them are done; the calling thread works on chunks too, so a pool of size 1
+has no background threads and runs everything inline.
+*/
+class ThreadPool {
+private:
+    vector<thread> workers; //background threads, size()-1 of them
+    mutex mtx;
+    condition_variable cv_start; //signals a new job to the workers
+    condition_variable cv_done; //signals the end of a job to the caller
+    const function<void(int)> * job; //job being run
+    int job_chunks; //number of chunks of the job
+    atomic<int> next_chunk; //next chunk to be taken
+    int busy_workers; //workers still running the job
+    long generation; //job counter, workers wait for it to change
+    bool stopping;
+
+    void workerLoop();
+    void runChunks(const function<void(int)> & fn, int nchunks);
+
+public:
+    ThreadPool(int nthreads);
+    ~ThreadPool();
+
+    //Number of threads working in a parallelFor, including the caller
+    int size() const { return (int)workers.size() + 1; }
+
+    //Runs fn(c) for c in [0, nchunks) over the pool threads
+    void parallelFor(int nchunks, const function<void(int)> & fn);
+
+    //Number of hardware threads of the machine (at least 1)
+    static int hardwareThreads();
+};
+
+ThreadPool::ThreadPool(int nthreads) : job(NULL), job_chunks(0), next_chunk(0),
+    busy_workers(0), generation(0), stopping(false) {
+    if (nthreads < 1)
+        nthreads = hardwareThreads();
+    for (int i = 1; i < nthreads; i++)
+        workers.push_back(thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        unique_lock<mutex> lock(mtx);
+        stopping = true;
+    }
+    cv_start.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+int ThreadPool::hardwareThreads() {
+    int n = (int)thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+void ThreadPool::runChunks(const function<void(int)> & fn, int nchunks) {
+    for (;;) {
+        int c = next_chunk.fetch_add(1);
+        if (c >= nchunks)
+            break;
+        fn(c);
+    }
+}
+
+void ThreadPool::workerLoop() {
+    long seen = 0;
+    for (;;) {
+        const function<void(int)> * fn;
+        int nchunks;
+        {
+            unique_lock<mutex> lock(mtx);
+            cv_start.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            fn = job;
+            nchunks = job_chunks;
+        }
+
+        runChunks(*fn, nchunks);
+
+        {
+            unique_lock<mutex> lock(mtx);
+            if (--busy_workers == 0)
+                cv_done.notify_one();
+        }
+    }
+}
+
+void ThreadPool::parallelFor(int nchunks, const function<void(int)> & fn) {
+    if (workers.empty() || nchunks <= 1) {
+        for (int c = 0; c < nchunks; c++)
+            fn(c);
+        return;
+    }
+
+    {
+        unique_lock<mutex> lock(mtx);
+        job = &fn;
+        job_chunks = nchunks;
+        next_chunk = 0;
+        busy_workers = (int)workers.size();
+        generation++;
+    }
+    cv_start.notify_all();
+
+    runChunks(fn, nchunks);
+
+    unique_lock<mutex> lock(mtx);
+    cv_done.wait(lock, [&] { return busy_workers == 0; });
+    job = NULL;
+}
+
+/*
+Pool of threads running independent tasks with work stealing.
+Every worker owns a deque; submitted tasks are dealt round-robin over the
+deques, a worker takes the newest task of its own deque and, once it is empty,
+steals the oldest task of the other deques, so no thread idles while any task
+is waiting.
+*/
+class TaskPool {
+private:
+    struct TaskQueue {
+        mutex mtx;
+        deque< function<void()> > tasks;
+    };
+
+    vector<thread> workers;
+    vector< unique_ptr<TaskQueue> > queues; //one deque per worker
+    mutex mtx;
+    condition_variable cv_work; //signals queued tasks to the workers
+    condition_variable cv_idle; //signals wait() that every task is finished
+    int queued; //tasks in the deques not yet claimed by a worker
+    int pending; //tasks submitted and not finished
+    int next_queue; //deque receiving the next task
+    bool stopping;
+
+    //Takes a task from deque w or steals one from another deque
+    bool takeTask(int w, function<void()> & task);
+    void workerLoop(int w);
+
+public:
+    TaskPool(int nthreads);
+    ~TaskPool();
+
+    int size() const { return (int)workers.size(); }
+
+    //Queues a task
+    void submit(const function<void()> & task);
+
+    //Blocks until every submitted task is finished
+    void wait();
+};
+
+TaskPool::TaskPool(int nthreads) : queued(0), pending(0), next_queue(0), stopping(false) {
+    if (nthreads < 1)
+        nthreads = ThreadPool::hardwareThreads();
+    for (int i = 0; i < nthreads; i++)
+        queues.push_back(unique_ptr<TaskQueue>(new TaskQueue()));
+    for (int i = 0; i < nthreads; i++)
+        workers.push_back(thread(&TaskPool::workerLoop, this, i));
+}
+
+TaskPool::~TaskPool() {
+    {
+        unique_lock<mutex> lock(mtx);
+        stopping = true;
+    }
+    cv_work.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+void TaskPool::submit(const function<void()> & task) {
+    int q;
+    {
+        unique_lock<mutex> lock(mtx);
+        q = next_queue;
+        next_queue = (next_queue + 1) % queues.size();
+        pending++;
+    }
+    {
+        unique_lock<mutex> qlock(queues[q]->mtx);
+        queues[q]->tasks.push_back(task);
+    }
+    {
+        unique_lock<mutex> lock(mtx);
+        queued++;
+    }
+    cv_work.notify_one();
+}
+
+bool TaskPool::takeTask(int w, function<void()> & task) {
+    int nq = queues.size();
+    for (int i = 0; i < nq; i++) {
+        TaskQueue & q = *queues[(w + i) % nq];
+        unique_lock<mutex> qlock(q.mtx);
+        if (q.tasks.empty())
+            continue;
+        if (i == 0) {
+            task = q.tasks.back();
+            q.tasks.pop_back();
+        }
+        else {
+            task = q.tasks.front();
+            q.tasks.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+void TaskPool::workerLoop(int w) {
+    for (;;) {
+        {
+            //Claims one of the queued tasks before looking for it
+            unique_lock<mutex> lock(mtx);
+            cv_work.wait(lock, [&] { return stopping || queued > 0; });
+            if (queued == 0)
+                return;
+            queued--;
+        }
+
+        function<void()> task;
+        while (takeTask(w, task) == false)
+            this_thread::yield();
+        task();
+
+        unique_lock<mutex> lock(mtx);
+        if (--pending == 0)
+            cv_idle.notify_all();
+    }
+}
+
+void TaskPool::wait() {
+    unique_lock<mutex> lock(mtx);
+    cv_idle.wait(lock, [&] { return pending == 0; });
+}
+
+#endif /*THREADPOOL_H_*/